@@ -0,0 +1,583 @@
+// Scaling benchmark for atlas-cpd.
+//
+// Runs the full Atlas pipeline (read, grid, register, write) over a matrix
+// of thread counts, cell sizes and point densities, on synthetic scenes
+// generated locally and optionally on a real pair of scenes. Each run is
+// made in a child process so that its peak memory can be measured on its
+// own. Results are written as JSON, one run per line, with strong or weak
+// scaling figures for each run relative to the run with the fewest threads
+// in its group. Given a baseline written by an earlier run, it reports the
+// runs whose throughput fell by more than a threshold and exits with
+// status 1 if there are any.
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <random>
+#include <sstream>
+
+#include <pdal/PointTable.hpp>
+#include <pdal/PointView.hpp>
+#include <pdal/StageFactory.hpp>
+#include <pdal/io/BufferReader.hpp>
+#include <pdal/util/FileUtils.hpp>
+#include <pdal/util/ProgramArgs.hpp>
+
+#include "src/Atlas.hpp"
+
+// Build configuration, recorded with the results (see CMakeLists.txt).
+#ifndef ATLAS_BUILD
+#define ATLAS_BUILD "unknown"
+#endif
+
+#ifdef ATLAS_PGO_GENERATE
+// Writes the profile counters, which _exit() would otherwise discard.
+extern "C" void __gcov_dump();
+#endif
+
+namespace AtlasProcessor
+{
+
+namespace
+{
+
+struct Scene
+{
+    std::string name;
+    std::string before;
+    std::string after;
+    double density;         // Points per square unit, if known.
+};
+
+struct Run
+{
+    Run() : threads(0), cellSize(0), density(0), peakKb(0), ok(false),
+        speedup(0), efficiency(0)
+    {}
+
+    std::string scene;
+    std::string mode;       // "strong" or "weak".
+    int threads;
+    int cellSize;
+    double density;
+    Atlas::Stats stats;
+    long peakKb;
+    bool ok;
+    std::string error;
+    double speedup;
+    double efficiency;
+
+    double total() const
+    {
+        return stats.load + stats.registration + stats.regularize +
+            stats.write;
+    }
+
+    double throughput() const
+        { return total() > 0 ? stats.points / total() : 0; }
+
+    // Runs that are compared for scaling.
+    std::string group() const
+    {
+        std::ostringstream ss;
+        ss << mode << "/" << scene << "/c" << cellSize;
+        return ss.str();
+    }
+
+    std::string key() const
+    {
+        std::ostringstream ss;
+        ss << group() << "/t" << threads;
+        return ss.str();
+    }
+};
+
+// Synthetic terrain with features at several scales.
+double surface(double x, double y)
+{
+    return 10 * std::sin(x / 37) + 6 * std::cos(y / 23) +
+        0.5 * std::sin((x + y) / 5);
+}
+
+// Smooth displacement applied to the 'after' scene.
+Eigen::Vector3d displacement(double x, double y)
+{
+    return Eigen::Vector3d(0.3 + 0.001 * x, -0.2 + 0.0005 * y,
+        0.05 * std::sin(x / 200));
+}
+
+void writeLas(const std::string& filename, const std::vector<double>& xyz)
+{
+    using namespace pdal;
+
+    PointTable table;
+    table.layout()->registerDims({ Dimension::Id::X, Dimension::Id::Y,
+        Dimension::Id::Z });
+    PointViewPtr view(new PointView(table));
+    for (PointId i = 0; i < xyz.size() / 3; ++i)
+    {
+        view->setField(Dimension::Id::X, i, xyz[3 * i]);
+        view->setField(Dimension::Id::Y, i, xyz[3 * i + 1]);
+        view->setField(Dimension::Id::Z, i, xyz[3 * i + 2]);
+    }
+
+    BufferReader reader;
+    reader.addView(view);
+
+    StageFactory factory;
+    Stage *writer = factory.createStage("writers.las");
+    Options opts;
+    opts.add("filename", filename);
+    opts.add("scale_x", 0.001);
+    opts.add("scale_y", 0.001);
+    opts.add("scale_z", 0.001);
+    writer->setOptions(opts);
+    writer->setInput(reader);
+    writer->prepare(table);
+    writer->execute(table);
+}
+
+// Write a pair of scenes 'side' units square with 'density' points per
+// square unit. The 'after' scene is an independent sampling of the same
+// surface, displaced.
+Scene makeScene(const std::string& dir, double side, double density)
+{
+    std::ostringstream name;
+    name << "synthetic-s" << side << "-d" << density;
+
+    Scene scene;
+    scene.name = name.str();
+    scene.before = dir + "/" + scene.name + "-before.las";
+    scene.after = dir + "/" + scene.name + "-after.las";
+    scene.density = density;
+
+    std::mt19937 gen(1);
+    std::uniform_real_distribution<double> pos(0, side);
+    std::normal_distribution<double> noise(0, 0.02);
+    size_t count = (size_t)(side * side * density);
+
+    std::vector<double> xyz;
+    xyz.reserve(3 * count);
+    for (size_t i = 0; i < count; ++i)
+    {
+        double x = pos(gen);
+        double y = pos(gen);
+        xyz.push_back(x);
+        xyz.push_back(y);
+        xyz.push_back(surface(x, y) + noise(gen));
+    }
+    writeLas(scene.before, xyz);
+
+    xyz.clear();
+    for (size_t i = 0; i < count; ++i)
+    {
+        double x = pos(gen);
+        double y = pos(gen);
+        Eigen::Vector3d p = Eigen::Vector3d(x, y, surface(x, y) + noise(gen)) +
+            displacement(x, y);
+        xyz.push_back(p(0));
+        xyz.push_back(p(1));
+        xyz.push_back(p(2));
+    }
+    writeLas(scene.after, xyz);
+
+    return scene;
+}
+
+// Run the pipeline in a child process and collect its statistics and peak
+// resident memory.
+void measure(Run& run, const Scene& scene, const std::string& dir)
+{
+    int fds[2];
+    if (pipe(fds) != 0)
+        throw pdal::pdal_error("Unable to create a pipe.");
+
+    pid_t pid = fork();
+    if (pid < 0)
+        throw pdal::pdal_error("Unable to fork.");
+    if (pid == 0)
+    {
+        close(fds[0]);
+        std::ostringstream out;
+        out << std::setprecision(17);
+        try
+        {
+            StringList args { scene.before, scene.after,
+                "--threads", std::to_string(run.threads),
+                "--cell_size", std::to_string(run.cellSize),
+                "--output", dir + "/out.tif" };
+            Atlas atlas;
+            atlas.execute(args);
+            const Atlas::Stats& s = atlas.stats();
+            out << "ok " << s.load << " " << s.registration << " " <<
+                s.regularize << " " << s.write << " " << s.points << " " <<
+                s.cells << " " << s.registered;
+        }
+        catch (const std::exception& err)
+        {
+            out << "error " << err.what();
+        }
+        std::string msg = out.str();
+        ssize_t unused = ::write(fds[1], msg.data(), msg.size());
+        (void)unused;
+        close(fds[1]);
+#ifdef ATLAS_PGO_GENERATE
+        __gcov_dump();
+#endif
+        _exit(0);
+    }
+
+    close(fds[1]);
+    std::string msg;
+    char buf[256];
+    ssize_t n;
+    while ((n = read(fds[0], buf, sizeof(buf))) > 0)
+        msg.append(buf, n);
+    close(fds[0]);
+
+    int status;
+    struct rusage usage;
+    wait4(pid, &status, 0, &usage);
+    run.peakKb = usage.ru_maxrss;
+
+    std::istringstream in(msg);
+    std::string result;
+    in >> result;
+    if (result == "ok")
+    {
+        Atlas::Stats& s = run.stats;
+        in >> s.load >> s.registration >> s.regularize >> s.write >>
+            s.points >> s.cells >> s.registered;
+        run.ok = true;
+    }
+    else
+    {
+        std::getline(in, run.error);
+        if (run.error.empty())
+            run.error = "child exited with status " + std::to_string(status);
+    }
+}
+
+// Fill in speedup and efficiency relative to the run in the same group
+// with the fewest threads.
+void scale(std::vector<Run>& runs)
+{
+    std::map<std::string, const Run *> base;
+    for (const Run& r : runs)
+        if (r.ok && (!base.count(r.group()) ||
+                r.threads < base[r.group()]->threads))
+            base[r.group()] = &r;
+
+    for (Run& r : runs)
+    {
+        if (!r.ok || r.total() <= 0)
+            continue;
+        const Run& b = *base[r.group()];
+        double ratio = b.total() / r.total();
+        double threads = (double)r.threads / b.threads;
+        // Strong scaling keeps the work fixed; weak scaling grows it with
+        // the thread count.
+        if (r.mode == "strong")
+        {
+            r.speedup = ratio;
+            r.efficiency = ratio / threads;
+        }
+        else
+        {
+            r.speedup = ratio * threads;
+            r.efficiency = ratio;
+        }
+    }
+}
+
+void writeJson(std::ostream& out, const std::vector<Run>& runs)
+{
+    out << std::setprecision(6) << "{\n  \"build\": \"" << ATLAS_BUILD <<
+        "\",\n  \"runs\": [\n";
+    for (size_t i = 0; i < runs.size(); ++i)
+    {
+        const Run& r = runs[i];
+        const Atlas::Stats& s = r.stats;
+        out << "    { \"key\": \"" << r.key() << "\", \"scene\": \"" <<
+            r.scene << "\", \"mode\": \"" << r.mode << "\", \"threads\": " <<
+            r.threads << ", \"cell_size\": " << r.cellSize <<
+            ", \"density\": " << r.density << ", \"ok\": " <<
+            (r.ok ? "true" : "false") << ", \"points\": " << s.points <<
+            ", \"cells\": " << s.cells << ", \"registered\": " <<
+            s.registered << ", \"load\": " << s.load <<
+            ", \"registration\": " << s.registration <<
+            ", \"regularize\": " << s.regularize << ", \"write\": " <<
+            s.write << ", \"total\": " << r.total() <<
+            ", \"throughput\": " << r.throughput() <<
+            ", \"peak_rss_kb\": " << r.peakKb << ", \"speedup\": " <<
+            r.speedup << ", \"efficiency\": " << r.efficiency << " }" <<
+            (i + 1 < runs.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n}\n";
+}
+
+void writeTable(std::ostream& out, const std::vector<Run>& runs)
+{
+    out << std::left << std::setw(44) << "run" << std::right <<
+        std::setw(9) << "load" << std::setw(9) << "reg" <<
+        std::setw(9) << "write" << std::setw(9) << "total" <<
+        std::setw(12) << "pts/s" << std::setw(10) << "peak MiB" <<
+        std::setw(9) << "speedup" << std::setw(6) << "eff" << "\n";
+    out << std::fixed;
+    for (const Run& r : runs)
+    {
+        out << std::left << std::setw(44) << r.key() << std::right;
+        if (!r.ok)
+        {
+            out << "  failed: " << r.error << "\n";
+            continue;
+        }
+        out << std::setprecision(2) << std::setw(9) << r.stats.load <<
+            std::setw(9) << r.stats.registration << std::setw(9) <<
+            r.stats.write << std::setw(9) << r.total() <<
+            std::setprecision(0) << std::setw(12) << r.throughput() <<
+            std::setw(10) << r.peakKb / 1024.0 << std::setprecision(2) <<
+            std::setw(9) << r.speedup << std::setw(6) << r.efficiency <<
+            "\n";
+    }
+}
+
+// Read the key and throughput of each run from JSON written by writeJson().
+std::map<std::string, double> readBaseline(const std::string& filename)
+{
+    std::map<std::string, double> baseline;
+
+    std::ifstream in(filename);
+    if (!in)
+        throw pdal::pdal_error("Unable to read baseline '" + filename + "'.");
+    std::string line;
+    while (std::getline(in, line))
+    {
+        const std::string keyTag("\"key\": \"");
+        const std::string tputTag("\"throughput\": ");
+        size_t k = line.find(keyTag);
+        size_t t = line.find(tputTag);
+        if (k == std::string::npos || t == std::string::npos)
+            continue;
+        k += keyTag.size();
+        std::string key = line.substr(k, line.find('"', k) - k);
+        baseline[key] = std::stod(line.substr(t + tputTag.size()));
+    }
+    return baseline;
+}
+
+// Report runs that failed, and those whose throughput fell by more than
+// 'threshold' (a fraction) from the baseline. Returns the number of both.
+size_t compare(const std::vector<Run>& runs,
+    const std::map<std::string, double>& baseline, double threshold)
+{
+    size_t regressions = 0;
+    for (const Run& r : runs)
+    {
+        // A failed run has no throughput to compare.
+        if (!r.ok)
+        {
+            std::cout << "FAILED " << r.key() << ": " << r.error << "\n";
+            regressions++;
+            continue;
+        }
+        auto bi = baseline.find(r.key());
+        if (bi == baseline.end() || bi->second <= 0)
+            continue;
+        double change = r.throughput() / bi->second - 1;
+        if (change < -threshold)
+        {
+            std::cout << "REGRESSION " << r.key() << ": " <<
+                std::setprecision(1) << std::fixed << (change * 100) <<
+                "% throughput\n";
+            regressions++;
+        }
+    }
+    return regressions;
+}
+
+class Benchmark
+{
+public:
+    Benchmark() : m_size(0), m_weak(false), m_repeat(0), m_threshold(0)
+    {}
+
+    int run(const StringList& s);
+
+private:
+    void addArgs();
+    Run best(Run run, const Scene& scene);
+
+    pdal::ProgramArgs m_args;
+    std::vector<int> m_threads;
+    std::vector<int> m_cellSizes;
+    std::vector<double> m_densities;
+    double m_size;
+    bool m_weak;
+    std::string m_before;
+    std::string m_after;
+    int m_repeat;
+    std::string m_output;
+    std::string m_baseline;
+    double m_threshold;
+    std::string m_dir;
+};
+
+
+void Benchmark::addArgs()
+{
+    m_args.add("threads", "Thread counts to run", m_threads);
+    m_args.add("cell_sizes", "Cell sizes to run", m_cellSizes);
+    m_args.add("densities", "Densities, in points per square unit, of the "
+        "synthetic scenes", m_densities);
+    m_args.add("size", "Side of the synthetic scenes", m_size, 1000.0);
+    m_args.add("weak", "Also run weak scaling, growing the synthetic scene "
+        "with the thread count", m_weak);
+    m_args.add("before", "'Before' scene of a real pair to run as well",
+        m_before);
+    m_args.add("after", "'After' scene of a real pair to run as well",
+        m_after);
+    m_args.add("repeat", "Runs of each configuration, of which the fastest "
+        "is kept", m_repeat, 1);
+    m_args.add("output", "File to which to write results as JSON (default "
+        "standard output)", m_output);
+    m_args.add("baseline", "Results of an earlier run to compare with",
+        m_baseline);
+    m_args.add("threshold", "Drop in throughput, as a fraction, reported "
+        "as a regression", m_threshold, 0.1);
+}
+
+
+Run Benchmark::best(Run run, const Scene& scene)
+{
+    run.scene = scene.name;
+    run.density = scene.density;
+
+    Run best;
+    for (int i = 0; i < (std::max)(m_repeat, 1); ++i)
+    {
+        Run r(run);
+        measure(r, scene, m_dir);
+        std::cerr << "atlas-bench: " << r.key() << (r.ok ? "" : " failed") <<
+            "\n";
+        if (!best.ok || (r.ok && r.total() < best.total()))
+            best = r;
+    }
+    return best;
+}
+
+
+int Benchmark::run(const StringList& s)
+{
+    addArgs();
+    try
+    {
+        m_args.parse(s);
+    }
+    catch (const pdal::arg_error& err)
+    {
+        std::cerr << "atlas-bench: " << err.what() << "\n";
+        return 2;
+    }
+#ifndef __OPTIMIZE__
+    std::cerr << "atlas-bench: built without optimization. Timings won't "
+        "reflect a release build.\n";
+#endif
+    if (m_threads.empty())
+        m_threads = { 1, 2, 4, 8 };
+    if (m_cellSizes.empty())
+        m_cellSizes = { 100 };
+    if (m_densities.empty())
+        m_densities = { 1, 4 };
+    std::sort(m_threads.begin(), m_threads.end());
+
+    char dir[] = "/tmp/atlas-bench-XXXXXX";
+    if (!mkdtemp(dir))
+    {
+        std::cerr << "atlas-bench: unable to create a temporary directory.\n";
+        return 2;
+    }
+    m_dir = dir;
+
+    std::vector<Run> runs;
+    std::vector<Scene> scenes;
+    for (double density : m_densities)
+        scenes.push_back(makeScene(m_dir, m_size, density));
+    if (m_before.size() && m_after.size())
+        scenes.push_back(Scene { "real", m_before, m_after, 0 });
+
+    Run run;
+    for (const Scene& scene : scenes)
+        for (int cellSize : m_cellSizes)
+            for (int threads : m_threads)
+            {
+                run.mode = "strong";
+                run.threads = threads;
+                run.cellSize = cellSize;
+                runs.push_back(best(run, scene));
+            }
+
+    // Weak scaling: the scene's area grows with the thread count.
+    if (m_weak)
+        for (double density : m_densities)
+            for (int threads : m_threads)
+            {
+                double side = m_size *
+                    std::sqrt((double)threads / m_threads[0]);
+                Scene scene = makeScene(m_dir, side, density);
+                std::ostringstream name;
+                name << "synthetic-d" << density;
+                scene.name = name.str();
+                for (int cellSize : m_cellSizes)
+                {
+                    run.mode = "weak";
+                    run.threads = threads;
+                    run.cellSize = cellSize;
+                    runs.push_back(best(run, scene));
+                }
+                scenes.push_back(scene);
+            }
+
+    scale(runs);
+    writeTable(std::cerr, runs);
+    if (m_output.size())
+    {
+        std::ofstream out(m_output);
+        writeJson(out, runs);
+    }
+    else
+        writeJson(std::cout, runs);
+
+    for (const Scene& scene : scenes)
+        if (scene.name != "real")
+        {
+            pdal::FileUtils::deleteFile(scene.before);
+            pdal::FileUtils::deleteFile(scene.after);
+        }
+    pdal::FileUtils::deleteFile(m_dir + "/out.tif");
+    pdal::FileUtils::deleteDirectory(m_dir);
+
+    if (m_baseline.size())
+        return compare(runs, readBaseline(m_baseline), m_threshold) ? 1 : 0;
+    return 0;
+}
+
+} // unnamed namespace
+
+} // namespace AtlasProcessor
+
+
+int main(int argc, const char *argv[])
+{
+    pdal::StringList slist(argv + 1, argv + argc);
+
+    AtlasProcessor::Benchmark bench;
+    return bench.run(slist);
+}
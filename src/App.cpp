@@ -1,9 +1,18 @@
 #include "Atlas.hpp"
+#include "Server.hpp"
 
 int main(int argc, const char *argv[])
 {
     pdal::StringList slist(argv + 1, argv + argc);
 
+    if (slist.size() && slist.front() == "server")
+    {
+        slist.erase(slist.begin());
+        AtlasProcessor::Server server;
+        server.run(slist);
+        return 0;
+    }
+
     AtlasProcessor::Atlas atlas;
     atlas.run(slist);
 }
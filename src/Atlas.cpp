@@ -1,9 +1,15 @@
 #include "Atlas.hpp"
 
-#include <pdal/private/gdal/GDALUtils.hpp>
-#include <pdal/private/gdal/Raster.hpp>
+#include <chrono>
+#include <cmath>
+#include <thread>
+
 #include <pdal/util/FileUtils.hpp>
 
+#include "GridTable.hpp"
+#include "RasterWriter.hpp"
+#include "Workspace.hpp"
+
 namespace AtlasProcessor
 {
 
@@ -13,9 +19,48 @@ void fatal(const std::string& err)
     exit(-1);
 }
 
-Atlas::Atlas() : m_transform(Eigen::Matrix4d::Identity())
+Atlas::Atlas(pdal::ThreadPool *pool) : m_pool(pool),
+    m_transform(Eigen::Matrix4d::Identity())
 {}
 
+namespace
+{
+
+// True if 'filename' is a COPC or EPT source, which can be read at reduced
+// resolution by reading only the upper levels of its octree.
+bool octree(const std::string& filename)
+{
+    std::string f = pdal::Utils::tolower(filename);
+    return pdal::Utils::endsWith(f, ".copc.laz") ||
+        pdal::Utils::endsWith(f, "ept.json");
+}
+
+// Parse a number of bytes, optionally followed by K, M, G or T (powers of
+// 1024). Returns false if 's' isn't of that form.
+bool parseBytes(const std::string& s, size_t& bytes)
+{
+    char *end;
+    double v = std::strtod(s.c_str(), &end);
+    std::string suffix = pdal::Utils::toupper(std::string(end));
+    if (end == s.c_str() || v < 0)
+        return false;
+
+    const std::string units = "KMGT";
+    if (suffix.size() > 1)
+        return false;
+    if (suffix.size())
+    {
+        size_t pos = units.find(suffix[0]);
+        if (pos == std::string::npos)
+            return false;
+        v *= std::pow(1024.0, (double)(pos + 1));
+    }
+    bytes = (size_t)v;
+    return true;
+}
+
+} // unnamed namespace
+
 void Atlas::throwError(const std::string& s)
 {
     throw std::runtime_error(s);
@@ -29,9 +74,102 @@ void Atlas::addArgs()
         m_afterFilename).setPositional();
     m_args.add("transform", "List of matrix entries - multiplied as"
         "written: A B C = A * B * C", m_transformSpecs).setOptionalPositional();
+    m_args.add("output", "Output raster filename. Defaults to "
+        "'/cpd_surface/<before stem>_cpd.out'", m_outputFilename);
+    m_args.add("cells", "Also write a record of each registered cell, as "
+        "it's registered (before 'regularize'), to this file. The format "
+        "is chosen by extension: .bin (binary table), .fgb, .parquet, "
+        ".gpkg or .geojson", m_cellsFilename);
+    m_args.add("points", "Also write each before point of each registered "
+        "cell, with its displacement and its distance (residual) from the "
+        "after scene once displaced, to this file: .bin (binary table), "
+        ".las or .laz", m_pointsFilename);
+    m_args.add("cell_size", "Length of a side of a grid cell", m_len, 100.0);
     m_args.add("minpts", "Minimum number of points in a cell to permit processing",
-        m_minpts, 250);
-    m_args.add("debug", "Dump transform and points", m_debug);
+        m_regOpts.minpts, 250);
+    m_args.add("debug", "Print each cell's transform", m_regOpts.debug);
+    m_args.add("classes", "Classification values of the points to use "
+        "(default all)", m_classes);
+    m_args.add("returns", "Returns to use: 'all', 'first', 'last' or 'only' "
+        "(points that are their pulse's only return)", m_returns, "all");
+    m_args.add("intensity_min", "Minimum intensity of the points to use",
+        m_filter.intensityMin, m_filter.intensityMin);
+    m_args.add("intensity_max", "Maximum intensity of the points to use",
+        m_filter.intensityMax, m_filter.intensityMax);
+    m_args.add("engine", "Registration method: 'cpd', 'icp' (trimmed "
+        "point-to-plane ICP, for small motion) or 'hybrid' (ICP, falling "
+        "back to CPD for cells where ICP does poorly)", m_engine, "cpd");
+    m_args.add("precision", "Scalar type of CPD's working coordinates: "
+        "'double' or 'float' (faster, in coordinates relative to each "
+        "cell)", m_precision, "double");
+    m_args.add("icp_iterations", "Maximum number of ICP iterations per cell",
+        m_regOpts.icpIterations, (size_t)30);
+    m_args.add("icp_trim", "Fraction of the closest point pairs used by each "
+        "ICP iteration", m_regOpts.icpTrim, 0.9);
+    m_args.add("icp_max_residual", "Largest RMS ICP residual, in scene "
+        "units, that 'hybrid' accepts", m_regOpts.icpMaxResidual, 0.1);
+    m_args.add("direct_limit", "Use the direct Gauss transform rather than "
+        "the fast Gauss transform for cells where the product of the before "
+        "and after point counts is no more than this value",
+        m_regOpts.directLimit, (size_t)4000000);
+    m_args.add("batch_size", "Number of small (direct transform) cells to "
+        "register together as a batch", m_regOpts.batchSize, (size_t)32);
+    m_args.add("max_iterations", "Maximum number of CPD iterations per cell",
+        m_regOpts.maxIterations, (size_t)150);
+    m_args.add("tolerance", "Stop when the relative change in the negative "
+        "log-likelihood falls to this value", m_regOpts.tolerance, 1e-5);
+    m_args.add("sigma2_tolerance", "Stop when the relative change in sigma2 "
+        "falls to this value (0 to disable)", m_regOpts.sigma2Tolerance, 0.0);
+    m_args.add("transform_tolerance", "Stop when points move no more than "
+        "this distance between iterations (0 to disable)",
+        m_regOpts.transformTolerance, 0.0);
+    m_args.add("time_budget", "Maximum registration time per cell in "
+        "seconds (0 to disable)", m_regOpts.timeBudget, 0.0);
+    m_args.add("anytime", "Keep the best transform found for cells that run "
+        "out of time rather than discarding them", m_regOpts.anytime);
+    m_args.add("bootstrap", "Number of registrations of random subsets of "
+        "each cell's points used to estimate the standard deviation of its "
+        "displacement, written as extra bands (0 for none)",
+        m_regOpts.bootstrap, (size_t)0);
+    m_args.add("bootstrap_fraction", "Fraction of each scene's points in "
+        "each 'bootstrap' subset", m_regOpts.bootstrapFraction, 0.5);
+    m_args.add("adaptive_levels", "Number of times a cell may be split "
+        "into quadrants, where it has more than 'max_points' points, or "
+        "merged with its neighbours into a block twice as wide, where it "
+        "has fewer than 'minpts' (0 for fixed cells, at most 16)",
+        m_regOpts.adaptiveLevels, 0);
+    m_args.add("max_points", "Most points in either scene of a cell, or "
+        "part of one, registered whole when 'adaptive_levels' is set",
+        m_regOpts.maxPoints, (size_t)20000);
+    m_args.add("regularize", "Replace cells whose displacement is an "
+        "outlier among their neighbours with the neighbours' median",
+        m_regularize.enabled);
+    m_args.add("regularize_radius", "Radius, in cells, of the neighbourhood "
+        "used by 'regularize'", m_regularize.radius, 1);
+    m_args.add("outlier_threshold", "Normalized median test threshold used "
+        "by 'regularize'", m_regularize.threshold, 2.0);
+    m_args.add("outlier_noise", "Expected displacement noise, in scene "
+        "units, used by 'regularize'", m_regularize.noise, 0.1);
+    m_args.add("workspace_stats", "Report the memory used by each worker's "
+        "registration workspace", m_workspaceStats);
+    m_args.add("memory_limit", "Approximate limit on the memory held by "
+        "points, e.g. '24G' (K, M, G or T). Cells beyond it are spilled to "
+        "disk and fewer are registered at once. 0 for no limit",
+        m_memoryLimitSpec, "0");
+    m_args.add("spill_dir", "Directory of the spill file used by "
+        "'memory_limit' (default the system's temporary directory)",
+        m_spillDir);
+    m_args.add("threads", "Number of threads used for registration",
+        m_threads, (int)std::thread::hardware_concurrency());
+    m_args.add("pipeline", "Register cells while the 'after' scene is being "
+        "read. Requires input sorted by row", m_pipeline);
+    m_args.add("band", "Number of rows of cells by which pipelined input "
+        "may be out of order (e.g. the height of a tile in cells)", m_band, 1);
+    m_args.add("point_budget", "For COPC and EPT input, read only as deep "
+        "into the octree as needed for about this many points per cell "
+        "(0 to read every point)", m_pointBudget, (size_t)0);
+    m_args.add("fetch_rows", "Number of rows of cells requested at a time "
+        "from COPC and EPT input", m_fetchRows, 8);
 }
 
 void Atlas::parse(const StringList& slist)
@@ -42,8 +180,61 @@ void Atlas::parse(const StringList& slist)
     }
     catch (const pdal::arg_error& err)
     {
-        fatal(err.what());
+        throwError(err.what());
+    }
+
+    if (m_len < 1 || m_len != std::floor(m_len))
+        throwError("'cell_size' must be a whole number no less than 1.");
+
+    for (int c : m_classes)
+    {
+        if (c < 0 || c >= (int)m_filter.classes.size())
+            throwError("Invalid 'classes' value " + std::to_string(c) + ".");
+        m_filter.classes.set(c);
+        m_filter.allClasses = false;
     }
+    if (m_returns == "all")
+        m_filter.returns = PointFilter::AllReturns;
+    else if (m_returns == "first")
+        m_filter.returns = PointFilter::FirstReturn;
+    else if (m_returns == "last")
+        m_filter.returns = PointFilter::LastReturn;
+    else if (m_returns == "only")
+        m_filter.returns = PointFilter::OnlyReturn;
+    else
+        throwError("Invalid 'returns' value '" + m_returns + "'.");
+
+    if (m_engine == "cpd")
+        m_regOpts.engine = RegistrationOptions::Cpd;
+    else if (m_engine == "icp")
+        m_regOpts.engine = RegistrationOptions::Icp;
+    else if (m_engine == "hybrid")
+        m_regOpts.engine = RegistrationOptions::Hybrid;
+    else
+        throwError("Invalid 'engine' value '" + m_engine + "'.");
+    if (!parseBytes(m_memoryLimitSpec, m_memoryLimit))
+        throwError("Invalid 'memory_limit' value '" + m_memoryLimitSpec +
+            "'.");
+    if (m_precision == "double")
+        m_regOpts.precision = RegistrationOptions::Double;
+    else if (m_precision == "float")
+        m_regOpts.precision = RegistrationOptions::Float;
+    else
+        throwError("Invalid 'precision' value '" + m_precision + "'.");
+    if (m_regOpts.icpTrim <= 0 || m_regOpts.icpTrim > 1)
+        throwError("'icp_trim' must be greater than 0 and no more than 1.");
+    if (m_regOpts.bootstrap == 1)
+        throwError("'bootstrap' must be 0 or at least 2.");
+    if (m_regOpts.bootstrapFraction <= 0 || m_regOpts.bootstrapFraction >= 1)
+        throwError("'bootstrap_fraction' must be between 0 and 1.");
+    // Each level quadruples the parts a cell may be split into.
+    if (m_regOpts.adaptiveLevels < 0 || m_regOpts.adaptiveLevels > 16)
+        throwError("'adaptive_levels' must be between 0 and 16.");
+    if (m_regOpts.adaptiveLevels > 0 &&
+            m_regOpts.maxPoints < (size_t)m_regOpts.minpts)
+        throwError("'max_points' must be no less than 'minpts'.");
+    if (m_regOpts.adaptiveLevels > 0 && m_pipeline)
+        throwError("'adaptive_levels' can't be used with 'pipeline'.");
 
     for (std::string s : m_transformSpecs)
     {
@@ -80,22 +271,125 @@ void Atlas::parse(const StringList& slist)
 
 void Atlas::run(const StringList& s)
 {
+    try
+    {
+        execute(s);
+    }
+    catch (const std::exception& err)
+    {
+        fatal(err.what());
+    }
+}
+
+void Atlas::execute(const StringList& s)
+{
+    using Clock = std::chrono::steady_clock;
+    auto seconds = [](Clock::time_point start)
+        { return std::chrono::duration<double>(Clock::now() - start).count(); };
+
     addArgs();
     parse(s);
-    try
+
+    std::string filename = m_outputFilename;
+    if (filename.empty())
+        filename = "/cpd_surface/" + pdal::FileUtils::stem(m_beforeFilename) + "_cpd.out";
+
+    Clock::time_point start = Clock::now();
+    load();
+    m_stats.load = seconds(start);
+
+    // Tiles of the raster are written as soon as all of their cells are
+    // registered, unless the field must be complete first: when regularized
+    // or pipelined (its extent isn't known until the end).
+    DisplacementGrid result;
+    std::unique_ptr<RasterWriter> raster;
+    start = Clock::now();
+    if (!m_pipeline)
+    {
+        // ICP searches the before points of each cell. Spilled cells
+        // build their indexes once reloaded.
+        if (m_regOpts.engine != RegistrationOptions::Cpd && !m_memoryLimit)
+            m_grid->buildIndex(Order::Before);
+        if (!m_regularize.enabled)
+        {
+            result = m_grid->displacements(m_regOpts.bootstrap > 0);
+            raster.reset(new RasterWriter(filename, result, m_srs));
+            m_grid->setTileOutput(&result, RasterWriter::TileSize,
+                [&raster](const DisplacementGrid::Tile& tile)
+                { raster->write(tile); });
+        }
+        m_grid->registration(m_regOpts);
+    }
+    m_stats.registration = seconds(start);
+
+    if (m_workspaceStats)
+        reportWorkspaces();
+    size_t timedOut = m_grid->countFlags(CellFlag::TimeLimit);
+    if (timedOut)
+        std::cerr << "atlas: " << timedOut << " cells ran out of time" <<
+            (m_regOpts.anytime ? "." : " and were discarded.") << "\n";
+    if (m_grid->spilledBytes())
+        std::cerr << "atlas: " << (m_grid->spilledBytes() >> 20) <<
+            " MiB of points spilled to disk.\n";
+    if (m_regOpts.engine == RegistrationOptions::Hybrid)
+        std::cerr << "atlas: " << m_grid->countFlags(CellFlag::Icp) <<
+            " cells registered by ICP, " <<
+            m_grid->countFlags(CellFlag::IcpRejected) << " by CPD.\n";
+
+    if (m_cellWriter)
+        m_cellWriter->close();
+    if (m_pointWriter)
+        m_pointWriter->close();
+
+    start = Clock::now();
+    if (!raster)
     {
-        load();
-        m_grid->registration(m_minpts, m_debug);
-        std::string filename = "/cpd_surface/" + pdal::FileUtils::stem(m_beforeFilename) + "_cpd.out";
+        result = m_grid->displacements(m_regOpts.bootstrap > 0);
+        if (m_regularize.enabled)
+        {
+            size_t replaced = m_grid->regularize(result, m_regularize);
+            std::cerr << "atlas: " << replaced << " outlier cells replaced.\n";
+        }
+    }
+    m_stats.regularize = seconds(start);
 
-        write(filename);
+    start = Clock::now();
+    if (!raster)
+    {
+        raster.reset(new RasterWriter(filename, result, m_srs));
+        for (const DisplacementGrid::Tile& tile :
+                result.tiles(RasterWriter::TileSize))
+            raster->write(tile);
     }
-    catch (const pdal::pdal_error& err)
+    raster->close();
+    m_stats.write = seconds(start);
+
+    m_stats.points = m_grid->pointCount();
+    m_stats.cells = m_grid->size();
+    for (size_t row = 0; row < result.ySize(); ++row)
+        for (size_t col = 0; col < result.xSize(); ++col)
+            if (result.valid(col, row))
+                m_stats.registered++;
+}
+
+void Atlas::reportWorkspaces()
+{
+    std::vector<Workspace::Stats> stats = Workspace::allStats();
+
+    size_t total = 0;
+    for (size_t i = 0; i < stats.size(); ++i)
     {
-        fatal(err.what());
+        const Workspace::Stats& s = stats[i];
+        std::cerr << "Workspace " << i << ": " << s.cells << " cells, " <<
+            "high water " << s.highWater / 1024 << " KiB, grew " <<
+            s.grows << " times.\n";
+        total += s.highWater;
     }
+    std::cerr << "Workspaces: " << stats.size() << ", combined high water " <<
+        total / 1024 << " KiB.\n";
 }
 
+
 void Atlas::load()
 {
     using namespace pdal;
@@ -105,57 +399,142 @@ void Atlas::load()
     ss << m_transform;
     transformOpts.add("matrix", ss.str());
 
-    StageCreationOptions bOps { m_beforeFilename };
-    Stage& beforeReader = m_beforeMgr.makeReader(bOps);
-    /**
-    Stage& beforeFilter = m_beforeMgr.makeFilter("filters.transformation",
-        beforeReader, transformOpts);
-    **/
-    m_beforeMgr.execute(ExecMode::Standard);
-
-    StageCreationOptions aOps { m_afterFilename };
-    Stage& afterReader = m_afterMgr.makeReader(aOps);
-    /**
-    Stage& afterFilter = m_afterMgr.makeFilter("filters.transformation",
-        afterReader, transformOpts);
-    **/
-    m_afterMgr.execute(ExecMode::Standard);
-
-    m_grid.reset(new Grid(m_len));
-    PointViewPtr bp = *(m_beforeMgr.views().begin());
-    m_grid->insert(bp, AP::Order::Before);
-
-    PointViewPtr ap = *(m_afterMgr.views().begin());
-    m_grid->insert(ap, AP::Order::After);
+    m_grid.reset(new Grid(m_len, m_threads, m_pool));
+    m_grid->setMemoryLimit(m_memoryLimit, m_spillDir);
+    if (m_cellsFilename.size())
+    {
+        m_cellWriter = CellWriter::create(m_cellsFilename, m_len, m_srs);
+        m_grid->setCellWriter(m_cellWriter.get());
+    }
+    if (m_pointsFilename.size())
+    {
+        m_pointWriter = PointWriter::create(m_pointsFilename, m_srs);
+        m_grid->setPointWriter(m_pointWriter.get());
+    }
+
+    if (m_pointBudget && octree(m_beforeFilename))
+        loadOctree(m_beforeFilename, AP::Order::Before);
+    else
+    {
+        StageCreationOptions bOps { m_beforeFilename };
+        Stage& beforeReader = m_beforeMgr.makeReader(bOps);
+        /**
+        Stage& beforeFilter = m_beforeMgr.makeFilter("filters.transformation",
+            beforeReader, transformOpts);
+        **/
+        if (beforeReader.pipelineStreamable())
+            stream(beforeReader, AP::Order::Before);
+        else
+        {
+            m_beforeMgr.execute(ExecMode::Standard);
+
+            PointViewPtr bp = *(m_beforeMgr.views().begin());
+            m_grid->insert(bp, AP::Order::Before, m_filter);
+        }
+    }
+
+    if (m_pointBudget && octree(m_afterFilename))
+        loadOctree(m_afterFilename, AP::Order::After);
+    else
+    {
+        StageCreationOptions aOps { m_afterFilename };
+        Stage& afterReader = m_afterMgr.makeReader(aOps);
+        /**
+        Stage& afterFilter = m_afterMgr.makeFilter("filters.transformation",
+            afterReader, transformOpts);
+        **/
+        if (m_pipeline)
+            loadPipelined(afterReader);
+        else if (afterReader.pipelineStreamable())
+            stream(afterReader, AP::Order::After);
+        else
+        {
+            m_afterMgr.execute(ExecMode::Standard);
+
+            PointViewPtr ap = *(m_afterMgr.views().begin());
+            m_grid->insert(ap, AP::Order::After, m_filter);
+        }
+    }
 
     m_grid->calcLimits();
 }
 
 
-void Atlas::write(const std::string& filename)
+// Stream the 'after' scene into the grid, registering cells as soon as the
+// stream has moved past them, rather than loading the entire scene first.
+void Atlas::loadPipelined(pdal::Stage& reader)
+{
+    using namespace pdal;
+    using namespace pdal::Dimension;
+
+    if (!reader.pipelineStreamable())
+        throwError("Reader for '" + m_afterFilename + "' doesn't support "
+            "streaming and can't be used with 'pipeline'.");
+
+    m_grid->startPipeline(m_regOpts, m_band);
+    stream(reader, AP::Order::After);
+    m_grid->finishPipeline();
+}
+
+
+// Read a COPC or EPT scene a band of rows of cells at a time. Each request
+// asks only for the octree nodes that overlap the band, down to the depth
+// at which a cell holds about 'point_budget' points, so the points that
+// lie deeper in the tree are never fetched or decoded. Bands are read in
+// row order, so with 'pipeline' the cells of one band of the 'after' scene
+// are registered while later bands are read.
+void Atlas::loadOctree(const std::string& filename, AP::Order order)
 {
     using namespace pdal;
 
+    QuickInfo info;
+    {
+        PipelineManager mgr;
+        info = mgr.makeReader(filename, "", Options()).preview();
+    }
+    if (!info.valid())
+        throwError("Unable to read the bounds of '" + filename + "'.");
+
+    // Point spacing at which a surface fills a cell with the budget.
+    double resolution = m_len / std::sqrt((double)m_pointBudget);
+    int rows = (std::max)(m_fetchRows, 1);
+    int first = int(std::floor(info.m_bounds.miny / m_len));
+    int last = int(std::floor(info.m_bounds.maxy / m_len));
 
-    std::array<double, 6> pixelToPos;
-    pixelToPos[0] = (m_grid->xOrigin() * m_len);
-    pixelToPos[1] = m_len;
-    pixelToPos[2] = 0;
-    pixelToPos[3] = (m_grid->yOrigin() * m_len);
-    pixelToPos[4] = 0;
-    pixelToPos[5] = m_len;
+    // Points within a band arrive in octree order.
+    bool pipelined = (m_pipeline && order == AP::Order::After);
+    if (pipelined)
+        m_grid->startPipeline(m_regOpts, (std::max)(m_band, rows));
+    for (int row = first; row <= last; row += rows)
+    {
+        std::ostringstream bounds;
+        bounds.precision(15);
+        bounds << "([" << info.m_bounds.minx << ", " <<
+            info.m_bounds.maxx << "], [" << row * m_len << ", " <<
+            (row + rows) * m_len << "])";
 
-    gdal::registerDrivers();
-    gdal::Raster raster(filename, "GTiff", "EPSG:32624", pixelToPos);
-    gdal::GDALError err = raster.open(m_grid->xSize(), m_grid->ySize(),
-        3, Dimension::Type::Float, -9999, pdal::StringList());
+        Options opts;
+        opts.add("bounds", bounds.str());
+        opts.add("resolution", resolution);
+        PipelineManager mgr;
+        Stage& reader = mgr.makeReader(filename, "", opts);
+        // Bounds are inclusive, so drop the points on the edge that
+        // belong to the next band.
+        stream(reader, order, row, row + rows);
+    }
+    if (pipelined)
+        m_grid->finishPipeline();
+}
 
-    if (err != gdal::GDALError::None)
-        throwError(raster.errorMsg());
 
-    raster.writeBand(GridIter(*m_grid, Dimension::Id::X), -9999.0, 1, "X");
-    raster.writeBand(GridIter(*m_grid, Dimension::Id::Y), -9999.0, 2, "Y");
-    raster.writeBand(GridIter(*m_grid, Dimension::Id::Z), -9999.0, 3, "Z");
+// Stream the points of 'reader' that fall in rows [begin, end) of cells
+// into the grid.
+void Atlas::stream(pdal::Stage& reader, AP::Order order, int begin, int end)
+{
+    GridTable table(*m_grid, order, 10000, m_filter);
+    table.setRows(begin, end);
+    reader.prepare(table);
+    reader.execute(table);
 }
 
 } // namespace
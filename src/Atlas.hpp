@@ -1,5 +1,7 @@
 #pragma once
 
+#include <limits>
+
 #include <pdal/PipelineManager.hpp>
 #include <pdal/PointView.hpp>
 #include <pdal/util/ProgramArgs.hpp>
@@ -17,29 +19,86 @@ using StringList = pdal::StringList;
 class Atlas
 {
 public:
-    Atlas();
+    // Registration tasks run on 'pool' if given, otherwise on a pool of
+    // the grid's own.
+    Atlas(pdal::ThreadPool *pool = nullptr);
 
+    // Run, reporting errors and exiting on failure.
     void run(const StringList& s);
+    // Run, throwing on failure.
+    void execute(const StringList& s);
+
+    // What execute() processed and the time, in seconds, that it spent in
+    // each phase.
+    struct Stats
+    {
+        Stats() : load(0), registration(0), regularize(0), write(0),
+            points(0), cells(0), registered(0)
+        {}
+
+        // Reading and gridding both scenes. Includes registration when
+        // pipelined.
+        double load;
+        // Includes writing raster tiles that finish during registration.
+        double registration;
+        double regularize;
+        // Writing the rest of the raster.
+        double write;
+        size_t points;
+        size_t cells;
+        size_t registered;
+    };
+
+    const Stats& stats() const
+        { return m_stats; }
 
 private:
     void addArgs();
     void load();
+    void loadPipelined(pdal::Stage& reader);
+    void loadOctree(const std::string& filename, AP::Order order);
+    void stream(pdal::Stage& reader, AP::Order order,
+        int begin = (std::numeric_limits<int>::lowest)(),
+        int end = (std::numeric_limits<int>::max)());
     void parse(const StringList& s);
     void throwError(const std::string& s);
-    void write(const std::string& filename);
+    void reportWorkspaces();
     
     pdal::ProgramArgs m_args;
     std::string m_beforeFilename;
     std::string m_afterFilename;
-    int m_minpts;
-    bool m_debug;
+    RegistrationOptions m_regOpts;
+    PointFilter m_filter;
+    RegularizeOptions m_regularize;
+    std::vector<int> m_classes;
+    std::string m_returns;
+    std::string m_engine;
+    std::string m_precision;
+    int m_threads;
+    bool m_pipeline;
+    int m_band;
+    size_t m_pointBudget;
+    int m_fetchRows;
+    bool m_workspaceStats;
+    std::string m_memoryLimitSpec;
+    size_t m_memoryLimit;
+    std::string m_spillDir;
+    std::string m_outputFilename;
+    std::string m_cellsFilename;
+    std::string m_pointsFilename;
+    // Must outlive the grid, whose tasks write to it.
+    std::unique_ptr<CellWriter> m_cellWriter;
+    std::unique_ptr<PointWriter> m_pointWriter;
     std::unique_ptr<Grid> m_grid;
+    pdal::ThreadPool *m_pool;
 
     StringList m_transformSpecs;
     Eigen::Matrix4d m_transform;
     pdal::PipelineManager m_beforeMgr;
     pdal::PipelineManager m_afterMgr;
-    const double m_len = 100.0;
+    Stats m_stats;
+    double m_len;
+    const std::string m_srs = "EPSG:32624";
 };
 
 } // namespace
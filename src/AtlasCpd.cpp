@@ -0,0 +1,29 @@
+#include "AtlasCpd.hpp"
+
+#include <thread>
+
+#include "Grid.hpp"
+
+namespace AtlasProcessor
+{
+
+DisplacementGrid registerScenes(PointSpan before, PointSpan after,
+    const SceneOptions& opts, pdal::ThreadPool *pool)
+{
+    int threads = opts.threads;
+    if (threads <= 0)
+        threads = (int)std::thread::hardware_concurrency();
+
+    Grid grid(opts.cellSize, threads, pool);
+    grid.insert(before.xyz, before.count, Order::Before);
+    grid.insert(after.xyz, after.count, Order::After);
+    grid.calcLimits();
+    grid.registration(opts.registration);
+    DisplacementGrid result =
+        grid.displacements(opts.registration.bootstrap > 0);
+    if (opts.regularize.enabled)
+        grid.regularize(result, opts.regularize);
+    return result;
+}
+
+} // namespace AtlasProcessor
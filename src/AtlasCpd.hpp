@@ -0,0 +1,49 @@
+#pragma once
+
+// In-memory interface to libatlascpd.
+
+#include <cstddef>
+
+#include "DisplacementGrid.hpp"
+#include "Types.hpp"
+
+namespace pdal
+{
+class ThreadPool;
+}
+
+namespace AtlasProcessor
+{
+
+// 'count' points stored as consecutive X, Y, Z values.
+struct PointSpan
+{
+    const double *xyz;
+    size_t count;
+};
+
+struct SceneOptions
+{
+    SceneOptions() : cellSize(100), threads(0)
+    {}
+
+    // Length of a side of a grid cell, in scene units.
+    int cellSize;
+    // Number of registration threads. Zero uses every hardware thread.
+    // Ignored when a pool is passed to registerScenes().
+    int threads;
+    RegistrationOptions registration;
+    // Applied to the result when enabled.
+    RegularizeOptions regularize;
+};
+
+// Grid both scenes, register each cell of 'after' onto 'before' and return
+// the displacement of every cell. The points are copied, so the spans need
+// only remain valid for the duration of the call. Registration runs on
+// 'pool' if given, which may be shared by concurrent calls. Throws
+// pdal::pdal_error if registration fails.
+DisplacementGrid registerScenes(PointSpan before, PointSpan after,
+    const SceneOptions& opts = SceneOptions(),
+    pdal::ThreadPool *pool = nullptr);
+
+} // namespace AtlasProcessor
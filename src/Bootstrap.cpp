@@ -0,0 +1,125 @@
+#include "Bootstrap.hpp"
+
+#include <cmath>
+#include <deque>
+#include <numeric>
+#include <random>
+
+#include "Engine.hpp"
+
+namespace AtlasProcessor
+{
+
+namespace
+{
+
+// Resampled points registered together, which bounds the memory used by a
+// batch.
+const size_t BatchPoints = 4000000;
+
+struct Resample
+{
+    size_t cell;            // Index in the cell list.
+    Engine::Result start;
+    PointList before;
+    PointList after;
+};
+
+// Copy 'count' of 'points', drawn at random without replacement, to 'out'.
+// 'order' is scratch space.
+void sample(const PointList& points, size_t count, std::mt19937_64& rng,
+    std::vector<size_t>& order, PointList& out)
+{
+    order.resize(points.size());
+    std::iota(order.begin(), order.end(), (size_t)0);
+    out.resize(count);
+    for (size_t i = 0; i < count; ++i)
+    {
+        std::uniform_int_distribution<size_t> pick(i, order.size() - 1);
+        std::swap(order[i], order[pick(rng)]);
+        out[i] = points[order[i]];
+    }
+}
+
+} // unnamed namespace
+
+void bootstrap(const std::vector<GridCell *>& cells,
+    const RegistrationOptions& opts)
+{
+    if (opts.bootstrap < 2)
+        return;
+
+    // The estimate from a subset of a fraction f of the points, drawn
+    // without replacement, varies about the estimate from all of them with
+    // (1 / f - 1) times the variance of the latter, so the spread of the
+    // resamples is scaled by sqrt(f / (1 - f)). With f = 0.5 (half
+    // sampling) it's used as is.
+    const double f = opts.bootstrapFraction;
+    const double correction = std::sqrt(f / (1 - f));
+
+    std::vector<Eigen::Vector3d> sumSq(cells.size(), Eigen::Vector3d::Zero());
+    std::vector<size_t> count(cells.size(), 0);
+    std::deque<Resample> batch;
+    size_t batchPoints = 0;
+
+    // Register the batch and accumulate the squared differences between the
+    // displacements of the resamples and those of their cells.
+    auto run = [&]()
+    {
+        if (batch.empty())
+            return;
+
+        std::unique_ptr<Engine> engine(Engine::create(opts));
+        for (const Resample& r : batch)
+            engine->add(r.before, r.after, nullptr, &r.start);
+        engine->run();
+        for (size_t j = 0; j < batch.size(); ++j)
+        {
+            Engine::Result res = engine->result(j);
+            if (!res.valid)
+                continue;
+            size_t i = batch[j].cell;
+            const GridCell& cell = *cells[i];
+            Eigen::Vector4d center = cell.m_center.homogeneous();
+            Eigen::Vector3d vec =
+                ((res.transform.inverse() * center) - center).head(3);
+            sumSq[i] += (vec - cell.m_vec).cwiseAbs2();
+            count[i]++;
+        }
+        batch.clear();
+        batchPoints = 0;
+    };
+
+    std::vector<size_t> order;
+    for (size_t i = 0; i < cells.size(); ++i)
+    {
+        const GridCell& cell = *cells[i];
+        if (!cell.m_registered)
+            continue;
+
+        // m_transform is the inverse of the registration result.
+        Engine::Result start { cell.m_transform.inverse(), cell.m_sigma2, 0,
+            0, true };
+        size_t nBefore = (size_t)std::ceil(f * cell.m_before.size());
+        size_t nAfter = (size_t)std::ceil(f * cell.m_after.size());
+        std::mt19937_64 rng(GridIndex(cell.m_x, cell.m_y).key());
+        for (size_t k = 0; k < opts.bootstrap; ++k)
+        {
+            batch.push_back({ i, start, PointList(), PointList() });
+            Resample& r = batch.back();
+            sample(cell.m_before, nBefore, rng, order, r.before);
+            sample(cell.m_after, nAfter, rng, order, r.after);
+            batchPoints += nBefore + nAfter;
+            if (batchPoints >= BatchPoints)
+                run();
+        }
+    }
+    run();
+
+    for (size_t i = 0; i < cells.size(); ++i)
+        if (count[i] >= 2)
+            cells[i]->m_std =
+                (sumSq[i] / (double)count[i]).cwiseSqrt() * correction;
+}
+
+} // namespace AtlasProcessor
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <vector>
+
+#include "Grid.hpp"
+#include "Types.hpp"
+
+namespace AtlasProcessor
+{
+
+// Estimate the uncertainty of the displacement of each registered cell in
+// 'cells' from opts.bootstrap registrations of random subsets of its points
+// (opts.bootstrapFraction of each scene, drawn without replacement), each
+// started from the cell's own result so that it converges in a few
+// iterations. Sets each cell's m_std to the standard deviation of each
+// component of its displacement. The resamples of all of the cells are
+// registered together, in batches, on the calling thread. Draws are seeded
+// by cell, so results don't depend on how cells are batched.
+void bootstrap(const std::vector<GridCell *>& cells,
+    const RegistrationOptions& opts);
+
+} // namespace AtlasProcessor
@@ -0,0 +1,226 @@
+#include "CellWriter.hpp"
+
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+#include <gdal.h>
+#include <ogr_api.h>
+#include <ogr_srs_api.h>
+
+#include <pdal/PointView.hpp>
+#include <pdal/util/FileUtils.hpp>
+#include <pdal/util/Utils.hpp>
+
+namespace AtlasProcessor
+{
+
+namespace
+{
+
+// Binary table: a 64-byte header followed by the records.
+struct BinaryHeader
+{
+    char magic[8];          // "ATLASCPD"
+    uint32_t version;
+    uint32_t recordSize;    // sizeof(CellRecord)
+    uint64_t count;         // Number of records.
+    double cellSize;
+    char reserved[32];
+};
+static_assert(sizeof(BinaryHeader) == 64, "Unexpected binary header size");
+static_assert(sizeof(CellRecord) == 208, "Unexpected cell record size");
+
+class BinaryCellWriter : public CellWriter
+{
+public:
+    BinaryCellWriter(const std::string& filename, double cellSize) :
+        m_out(filename, std::ios::binary | std::ios::trunc)
+    {
+        if (!m_out)
+            throw pdal::pdal_error("Unable to create '" + filename + "'.");
+
+        std::memset(&m_header, 0, sizeof(m_header));
+        std::memcpy(m_header.magic, "ATLASCPD", sizeof(m_header.magic));
+        m_header.version = 2;
+        m_header.recordSize = sizeof(CellRecord);
+        m_header.cellSize = cellSize;
+        m_out.write(reinterpret_cast<const char *>(&m_header),
+            sizeof(m_header));
+    }
+
+    ~BinaryCellWriter()
+        { close(); }
+
+protected:
+    virtual void writeRecord(const CellRecord& rec)
+    {
+        m_out.write(reinterpret_cast<const char *>(&rec), sizeof(rec));
+        m_header.count++;
+    }
+
+    // The count isn't known until the end, so the header is rewritten.
+    virtual void finish()
+    {
+        m_out.seekp(0);
+        m_out.write(reinterpret_cast<const char *>(&m_header),
+            sizeof(m_header));
+        m_out.close();
+    }
+
+private:
+    std::ofstream m_out;
+    BinaryHeader m_header;
+};
+
+
+// Points at the cell centers, with the record's values as attributes.
+class OgrCellWriter : public CellWriter
+{
+public:
+    OgrCellWriter(const std::string& filename, const std::string& driverName,
+        const std::string& srs) : m_ds(nullptr), m_layer(nullptr)
+    {
+        GDALAllRegister();
+        GDALDriverH driver = GDALGetDriverByName(driverName.c_str());
+        if (!driver)
+            throw pdal::pdal_error("GDAL driver '" + driverName + "' isn't "
+                "available to write '" + filename + "'.");
+        m_ds = GDALCreate(driver, filename.c_str(), 0, 0, 0, GDT_Unknown,
+            nullptr);
+        if (!m_ds)
+            throw pdal::pdal_error("Unable to create '" + filename + "'.");
+
+        OGRSpatialReferenceH ref = OSRNewSpatialReference(nullptr);
+        OSRSetFromUserInput(ref, srs.c_str());
+        m_layer = GDALDatasetCreateLayer(m_ds, "cells", ref, wkbPoint,
+            nullptr);
+        OSRRelease(ref);
+        if (!m_layer)
+        {
+            GDALClose(m_ds);
+            throw pdal::pdal_error("Unable to create a layer in '" +
+                filename + "'.");
+        }
+
+        addField("x", OFTInteger);
+        addField("y", OFTInteger);
+        addField("flags", OFTInteger);
+        addField("iterations", OFTInteger);
+        addField("dx", OFTReal);
+        addField("dy", OFTReal);
+        addField("dz", OFTReal);
+        for (int r = 0; r < 3; ++r)
+            for (int c = 0; c < 4; ++c)
+                addField("t" + std::to_string(r) + std::to_string(c),
+                    OFTReal);
+        addField("sigma2", OFTReal);
+        addField("sdx", OFTReal);
+        addField("sdy", OFTReal);
+        addField("sdz", OFTReal);
+        addField("before", OFTInteger64);
+        addField("after", OFTInteger64);
+    }
+
+    ~OgrCellWriter()
+        { close(); }
+
+protected:
+    virtual void writeRecord(const CellRecord& rec)
+    {
+        OGRFeatureH f = OGR_F_Create(OGR_L_GetLayerDefn(m_layer));
+        int i = 0;
+        OGR_F_SetFieldInteger(f, i++, rec.x);
+        OGR_F_SetFieldInteger(f, i++, rec.y);
+        OGR_F_SetFieldInteger(f, i++, (int)rec.flags);
+        OGR_F_SetFieldInteger(f, i++, (int)rec.iterations);
+        for (double d : rec.vec)
+            OGR_F_SetFieldDouble(f, i++, d);
+        for (double d : rec.transform)
+            OGR_F_SetFieldDouble(f, i++, d);
+        OGR_F_SetFieldDouble(f, i++, rec.sigma2);
+        for (double d : rec.std)
+            OGR_F_SetFieldDouble(f, i++, d);
+        OGR_F_SetFieldInteger64(f, i++, (GIntBig)rec.beforeCount);
+        OGR_F_SetFieldInteger64(f, i++, (GIntBig)rec.afterCount);
+
+        OGRGeometryH g = OGR_G_CreateGeometry(wkbPoint);
+        OGR_G_SetPoint_2D(g, 0, rec.center[0], rec.center[1]);
+        OGR_F_SetGeometryDirectly(f, g);
+        OGRErr err = OGR_L_CreateFeature(m_layer, f);
+        OGR_F_Destroy(f);
+        if (err != OGRERR_NONE)
+            throw pdal::pdal_error("Unable to write cell " +
+                std::to_string(rec.x) + "/" + std::to_string(rec.y) + ".");
+    }
+
+    virtual void finish()
+    {
+        GDALClose(m_ds);
+        m_ds = nullptr;
+    }
+
+private:
+    void addField(const std::string& name, OGRFieldType type)
+    {
+        OGRFieldDefnH fd = OGR_Fld_Create(name.c_str(), type);
+        OGR_L_CreateField(m_layer, fd, TRUE);
+        OGR_Fld_Destroy(fd);
+    }
+
+    GDALDatasetH m_ds;
+    OGRLayerH m_layer;
+};
+
+} // unnamed namespace
+
+CellWriter::CellWriter() : m_closed(false)
+{}
+
+
+CellWriter::~CellWriter()
+{}
+
+
+std::unique_ptr<CellWriter> CellWriter::create(const std::string& filename,
+    double cellSize, const std::string& srs)
+{
+    std::string ext = pdal::Utils::tolower(pdal::FileUtils::extension(filename));
+
+    std::unique_ptr<CellWriter> w;
+    if (ext == ".bin")
+        w.reset(new BinaryCellWriter(filename, cellSize));
+    else if (ext == ".fgb")
+        w.reset(new OgrCellWriter(filename, "FlatGeobuf", srs));
+    else if (ext == ".parquet")
+        w.reset(new OgrCellWriter(filename, "Parquet", srs));
+    else if (ext == ".gpkg")
+        w.reset(new OgrCellWriter(filename, "GPKG", srs));
+    else if (ext == ".geojson" || ext == ".json")
+        w.reset(new OgrCellWriter(filename, "GeoJSON", srs));
+    else
+        throw pdal::pdal_error("Can't determine the format of '" + filename +
+            "' from its extension.");
+    return w;
+}
+
+
+void CellWriter::write(const CellRecord& rec)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!m_closed)
+        writeRecord(rec);
+}
+
+
+void CellWriter::close()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!m_closed)
+    {
+        m_closed = true;
+        finish();
+    }
+}
+
+} // namespace AtlasProcessor
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace AtlasProcessor
+{
+
+// Result of registering one cell. The layout is fixed, 8-byte aligned and
+// free of padding, so a binary table of these can be memory-mapped.
+struct CellRecord
+{
+    int32_t x;              // Cell index.
+    int32_t y;
+    uint32_t flags;         // CellFlag values.
+    uint32_t iterations;
+    double center[3];       // Cell center, at the mean height of 'before'.
+    double vec[3];          // Displacement of the center.
+    // Top three rows, row-major, of the transform that maps the before
+    // scene onto the after scene.
+    double transform[12];
+    double sigma2;
+    // Standard deviation of each component of 'vec' (see bootstrap()), or
+    // DisplacementGrid::NoData.
+    double std[3];
+    uint64_t beforeCount;
+    uint64_t afterCount;
+};
+
+// Writes a record per registered cell as cells finish. write() may be
+// called from any thread.
+class CellWriter
+{
+public:
+    virtual ~CellWriter();
+
+    // Create a writer for 'filename', chosen by its extension: ".bin" for
+    // a binary table, otherwise an OGR vector format of points at the cell
+    // centers (e.g. ".fgb" for FlatGeobuf, ".parquet" for GeoParquet or
+    // ".gpkg" for GeoPackage). Throws pdal::pdal_error on failure.
+    static std::unique_ptr<CellWriter> create(const std::string& filename,
+        double cellSize, const std::string& srs);
+
+    void write(const CellRecord& rec);
+    // Complete the file. Writers close themselves when destroyed if this
+    // hasn't been called.
+    void close();
+
+protected:
+    CellWriter();
+
+    virtual void writeRecord(const CellRecord& rec) = 0;
+    virtual void finish() = 0;
+
+private:
+    std::mutex m_mutex;
+    bool m_closed;
+};
+
+} // namespace AtlasProcessor
@@ -0,0 +1,91 @@
+#include "DisplacementGrid.hpp"
+
+#include <algorithm>
+
+namespace AtlasProcessor
+{
+
+constexpr double DisplacementGrid::NoData;
+
+DisplacementGrid::DisplacementGrid() : m_cellSize(0), m_xOrigin(0),
+    m_yOrigin(0), m_xSize(0), m_ySize(0)
+{}
+
+
+DisplacementGrid::DisplacementGrid(double cellSize, int xOrigin, int yOrigin,
+        size_t xSize, size_t ySize) : m_cellSize(cellSize),
+    m_xOrigin(xOrigin), m_yOrigin(yOrigin), m_xSize(xSize), m_ySize(ySize)
+{
+    for (std::vector<double>& b : m_band)
+        b.resize(xSize * ySize, NoData);
+    m_flags.resize(xSize * ySize);
+}
+
+
+void DisplacementGrid::addStdBands()
+{
+    for (std::vector<double>& b : m_std)
+        b.resize(m_xSize * m_ySize, NoData);
+}
+
+
+std::array<double, 6> DisplacementGrid::geoTransform() const
+{
+    std::array<double, 6> t;
+    t[0] = m_xOrigin * m_cellSize;
+    t[1] = m_cellSize;
+    t[2] = 0;
+    t[3] = m_yOrigin * m_cellSize;
+    t[4] = 0;
+    t[5] = m_cellSize;
+    return t;
+}
+
+
+std::vector<DisplacementGrid::Tile> DisplacementGrid::tiles(size_t size) const
+{
+    std::vector<Tile> tiles;
+    if (size == 0)
+        return tiles;
+
+    for (size_t row = 0; row < m_ySize; row += size)
+        for (size_t col = 0; col < m_xSize; col += size)
+            tiles.push_back({ col, row, (std::min)(size, m_xSize - col),
+                (std::min)(size, m_ySize - row) });
+    return tiles;
+}
+
+
+Eigen::Vector3d DisplacementGrid::displacement(size_t col, size_t row) const
+{
+    size_t i = index(col, row);
+    return Eigen::Vector3d(m_band[0][i], m_band[1][i], m_band[2][i]);
+}
+
+
+Eigen::Vector3d DisplacementGrid::std(size_t col, size_t row) const
+{
+    size_t i = index(col, row);
+    return Eigen::Vector3d(m_std[0][i], m_std[1][i], m_std[2][i]);
+}
+
+
+void DisplacementGrid::set(size_t col, size_t row, const Eigen::Vector3d& vec,
+    unsigned flags)
+{
+    size_t i = index(col, row);
+    for (int d = 0; d < 3; ++d)
+        m_band[d][i] = vec(d);
+    m_flags[i] = flags;
+}
+
+
+void DisplacementGrid::setStd(size_t col, size_t row,
+    const Eigen::Vector3d& std)
+{
+    size_t i = index(col, row);
+    for (int d = 0; d < 3; ++d)
+        m_std[d][i] = std(d);
+}
+
+} // namespace AtlasProcessor
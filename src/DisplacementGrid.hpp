@@ -0,0 +1,112 @@
+#pragma once
+
+#include <array>
+#include <vector>
+
+#include <Eigen/Dense>
+
+namespace AtlasProcessor
+{
+
+// Registration result for every cell of the grid's bounding box, stored as
+// dense, row-major bands. Row 0 is the row of cells with the lowest Y.
+// Cells that weren't registered hold NoData in every band.
+//
+// Grids may also hold the standard deviation of each component (see
+// bootstrap()), NoData where it wasn't estimated.
+//
+// Rows, and the rows of tiles, are contiguous spans of each band, so
+// passes over the grid can work a span at a time. Concurrent readers are
+// safe, as are concurrent writers to disjoint cells (see
+// Grid::parallelFor()).
+class DisplacementGrid
+{
+public:
+    static constexpr double NoData = -9999.0;
+
+    // A block of cells.
+    struct Tile
+    {
+        size_t col;
+        size_t row;
+        size_t cols;
+        size_t rows;
+    };
+
+    DisplacementGrid();
+    // 'xOrigin' and 'yOrigin' are the cell indices of column and row 0.
+    DisplacementGrid(double cellSize, int xOrigin, int yOrigin,
+        size_t xSize, size_t ySize);
+
+    size_t xSize() const
+        { return m_xSize; }
+    size_t ySize() const
+        { return m_ySize; }
+    int xOrigin() const
+        { return m_xOrigin; }
+    int yOrigin() const
+        { return m_yOrigin; }
+    double cellSize() const
+        { return m_cellSize; }
+
+    // Affine transform from (column, row) to scene coordinates, as GDAL.
+    std::array<double, 6> geoTransform() const;
+
+    bool valid(size_t col, size_t row) const
+        { return m_band[0][index(col, row)] != NoData; }
+    Eigen::Vector3d displacement(size_t col, size_t row) const;
+    // CellFlag values.
+    unsigned flags(size_t col, size_t row) const
+        { return m_flags[index(col, row)]; }
+
+    // Add the standard deviation bands, if not already present.
+    void addStdBands();
+    bool hasStd() const
+        { return !m_std[0].empty(); }
+    // Standard deviation of each component, if hasStd().
+    Eigen::Vector3d std(size_t col, size_t row) const;
+
+    // Component 'dim' (0 = X, 1 = Y, 2 = Z) of every cell's displacement.
+    const double *band(int dim) const
+        { return m_band[dim].data(); }
+
+    // The xSize() cells of row 'row' of band 'dim'. The span of the
+    // following row starts stride() values further on.
+    const double *row(int dim, size_t row) const
+        { return m_band[dim].data() + index(0, row); }
+    double *row(int dim, size_t row)
+        { return m_band[dim].data() + index(0, row); }
+    // As row(), for the standard deviation bands.
+    const double *stdRow(int dim, size_t row) const
+        { return m_std[dim].data() + index(0, row); }
+    const unsigned *flagRow(size_t row) const
+        { return m_flags.data() + index(0, row); }
+    unsigned *flagRow(size_t row)
+        { return m_flags.data() + index(0, row); }
+    size_t stride() const
+        { return m_xSize; }
+
+    // Tiles of at most 'size' x 'size' cells that cover the grid, in
+    // row-major order. Row 'r' of band 'dim' of tile 't' is the t.cols
+    // values at row(dim, t.row + r) + t.col.
+    std::vector<Tile> tiles(size_t size) const;
+
+    void set(size_t col, size_t row, const Eigen::Vector3d& vec,
+        unsigned flags);
+    void setStd(size_t col, size_t row, const Eigen::Vector3d& std);
+
+private:
+    size_t index(size_t col, size_t row) const
+        { return row * m_xSize + col; }
+
+    double m_cellSize;
+    int m_xOrigin;
+    int m_yOrigin;
+    size_t m_xSize;
+    size_t m_ySize;
+    std::vector<double> m_band[3];
+    std::vector<double> m_std[3];
+    std::vector<unsigned> m_flags;
+};
+
+} // namespace AtlasProcessor
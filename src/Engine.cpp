@@ -0,0 +1,126 @@
+#include "Engine.hpp"
+
+#include "Icp.hpp"
+
+namespace AtlasProcessor
+{
+
+namespace
+{
+
+class CpdEngine : public Engine
+{
+public:
+    CpdEngine(const RegistrationOptions& opts) : m_batch(opts)
+    {}
+
+    virtual size_t add(const PointList& fixed, const PointList& moving,
+            const KdTree *, const Result *start)
+        { return m_batch.add(fixed, moving, start); }
+    virtual void run()
+        { m_batch.run(); }
+    virtual Result result(size_t i) const
+        { return m_batch.result(i); }
+
+private:
+    RigidBatch m_batch;
+};
+
+
+class IcpEngine : public Engine
+{
+public:
+    IcpEngine(const RegistrationOptions& opts) : m_opts(opts)
+    {}
+
+    virtual size_t add(const PointList& fixed, const PointList& moving,
+        const KdTree *index, const Result *start)
+    {
+        Problem p { &fixed, &moving, index, start != nullptr, Result() };
+        if (start)
+            p.start = *start;
+        m_problems.push_back(p);
+        return m_problems.size() - 1;
+    }
+
+    virtual void run()
+    {
+        // Only the accepted results are valid in hybrid mode. Those that
+        // aren't are run again with CPD, as a batch.
+        bool hybrid = (m_opts.engine == RegistrationOptions::Hybrid);
+        std::vector<size_t> rejected;
+
+        TrimmedIcp icp(m_opts);
+        m_results.resize(m_problems.size());
+        for (size_t i = 0; i < m_problems.size(); ++i)
+        {
+            const Problem& p = m_problems[i];
+            TrimmedIcp::Result ir = icp.run(*p.fixed, *p.moving, p.index,
+                p.warm ? &p.start.transform : nullptr);
+
+            Result& r = m_results[i];
+            r.transform = ir.transform;
+            r.sigma2 = ir.residual * ir.residual;
+            r.iterations = ir.iterations;
+            r.flags = CellFlag::Icp;
+            if (!ir.converged)
+                r.flags |= CellFlag::IterationLimit;
+            r.valid = ir.valid;
+
+            if (hybrid && (!ir.valid || !ir.converged ||
+                    ir.residual > m_opts.icpMaxResidual))
+                rejected.push_back(i);
+        }
+
+        if (rejected.empty())
+            return;
+        RigidBatch cpd(m_opts);
+        for (size_t i : rejected)
+        {
+            const Problem& p = m_problems[i];
+            cpd.add(*p.fixed, *p.moving, p.warm ? &p.start : nullptr);
+        }
+        cpd.run();
+        for (size_t j = 0; j < rejected.size(); ++j)
+        {
+            Result& r = m_results[rejected[j]];
+            r = cpd.result(j);
+            r.flags |= CellFlag::IcpRejected;
+        }
+    }
+
+    virtual Result result(size_t i) const
+        { return m_results[i]; }
+
+private:
+    struct Problem
+    {
+        const PointList *fixed;
+        const PointList *moving;
+        const KdTree *index;
+        bool warm;
+        Result start;
+    };
+
+    RegistrationOptions m_opts;
+    std::vector<Problem> m_problems;
+    std::vector<Result> m_results;
+};
+
+} // unnamed namespace
+
+std::unique_ptr<Engine> Engine::create(const RegistrationOptions& opts)
+{
+    std::unique_ptr<Engine> engine;
+    if (opts.engine == RegistrationOptions::Cpd)
+        engine.reset(new CpdEngine(opts));
+    else
+        engine.reset(new IcpEngine(opts));
+    return engine;
+}
+
+
+Engine::~Engine()
+{}
+
+} // namespace AtlasProcessor
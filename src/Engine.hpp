@@ -0,0 +1,45 @@
+#pragma once
+
+#include <memory>
+
+#include "KdTree.hpp"
+#include "RigidBatch.hpp"
+#include "Types.hpp"
+
+namespace AtlasProcessor
+{
+
+// Rigid registration of one or more point sets, by the method chosen by
+// RegistrationOptions::engine:
+//
+//  - Cpd: coherent point drift (RigidBatch).
+//  - Icp: trimmed point-to-plane ICP (TrimmedIcp). Results flagged
+//    CellFlag::Icp.
+//  - Hybrid: ICP, falling back to CPD for problems where ICP didn't
+//    converge to a well-posed result with a residual no more than
+//    'icpMaxResidual'. Those results are flagged CellFlag::IcpRejected.
+//
+// Problems are added, run together and their results read back, so that
+// engines that gain from batching can batch. The point lists (and indexes)
+// must outlive run().
+class Engine
+{
+public:
+    using Result = RigidBatch::Result;
+
+    static std::unique_ptr<Engine> create(const RegistrationOptions& opts);
+
+    virtual ~Engine();
+
+    // Add a problem that moves 'moving' onto 'fixed'. 'index', if given,
+    // is an index of 'fixed' for engines that need one. 'start', if given,
+    // is a result to start from, such as that of a similar problem.
+    // Returns the problem's index.
+    virtual size_t add(const PointList& fixed, const PointList& moving,
+        const KdTree *index = nullptr, const Result *start = nullptr) = 0;
+    // Run all problems until they stop.
+    virtual void run() = 0;
+    virtual Result result(size_t i) const = 0;
+};
+
+} // namespace AtlasProcessor
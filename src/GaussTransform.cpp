@@ -0,0 +1,610 @@
+#include "GaussTransform.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <string>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define ATLAS_X86_SIMD
+#include <immintrin.h>
+#endif
+
+namespace AtlasProcessor
+{
+
+namespace
+{
+
+template <typename T>
+using AffinityFn = double (*)(const T *, size_t, const T *, size_t, double,
+    double, T *, T *, T *, T *);
+
+struct Kernel
+{
+    const char *name;
+    AffinityFn<double> fn;
+    AffinityFn<float> floatFn;
+};
+
+// Weight of the uniform (outlier) component of the mixture.
+double outlierTerm(size_t n, size_t m, double sigma2, double outliers)
+{
+    const double pi = 3.14159265358979323846;
+
+    return (outliers * m * std::pow(2.0 * sigma2 * pi, 1.5)) /
+        ((1 - outliers) * n);
+}
+
+
+template <typename T>
+double affinityScalar(const T *fixed, size_t n, const T *moving, size_t m,
+    double sigma2, double outliers, T *p1, T *pt1, T *px, T *work)
+{
+    const T *mx = moving;
+    const T *my = moving + m;
+    const T *mz = moving + 2 * m;
+    T *pxx = px;
+    T *pxy = px + m;
+    T *pxz = px + 2 * m;
+    const T ksig = T(-2.0 * sigma2);
+    const double outlierTmp = outlierTerm(n, m, sigma2, outliers);
+
+    std::fill(p1, p1 + m, T(0));
+    std::fill(px, px + 3 * m, T(0));
+    double l = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+        T x = fixed[i];
+        T y = fixed[n + i];
+        T z = fixed[2 * n + i];
+
+        double sp = 0;
+        for (size_t j = 0; j < m; ++j)
+        {
+            T dx = x - mx[j];
+            T dy = y - my[j];
+            T dz = z - mz[j];
+            work[j] = std::exp((dx * dx + dy * dy + dz * dz) / ksig);
+            sp += work[j];
+        }
+        sp += outlierTmp;
+        pt1[i] = T(1 - outlierTmp / sp);
+
+        T inv = T(1.0 / sp);
+        for (size_t j = 0; j < m; ++j)
+        {
+            T w = work[j] * inv;
+            p1[j] += w;
+            pxx[j] += x * w;
+            pxy[j] += y * w;
+            pxz[j] += z * w;
+        }
+        l -= std::log(sp);
+    }
+    return l + 3 * n * std::log(sigma2) / 2;
+}
+
+#ifdef ATLAS_X86_SIMD
+
+// Taylor coefficients 1/13! ... 1/0! for exp(r), |r| <= ln(2) / 2, where the
+// truncation error is below 1e-16.
+const double ExpCoeffs[] =
+{
+    1.0 / 6227020800.0, 1.0 / 479001600.0, 1.0 / 39916800.0,
+    1.0 / 3628800.0, 1.0 / 362880.0, 1.0 / 40320.0, 1.0 / 5040.0,
+    1.0 / 720.0, 1.0 / 120.0, 1.0 / 24.0, 1.0 / 6.0, 0.5, 1.0, 1.0
+};
+const size_t NumExpCoeffs = sizeof(ExpCoeffs) / sizeof(ExpCoeffs[0]);
+
+// ln(2) split so that n * Ln2Hi is exact for the n we see.
+const double Ln2Hi = 6.93145751953125e-1;
+const double Ln2Lo = 1.42860682030941723212e-6;
+const double Log2e = 1.4426950408889634;
+const double ExpMin = -700.0;
+
+// Arguments below ExpMin yield zero, which avoids subnormal arithmetic.
+__attribute__((target("avx2,fma")))
+inline __m256d exp256(__m256d x)
+{
+    __m256d live = _mm256_cmp_pd(x, _mm256_set1_pd(ExpMin), _CMP_GE_OQ);
+    x = _mm256_max_pd(x, _mm256_set1_pd(ExpMin));
+    __m256d n = _mm256_round_pd(_mm256_mul_pd(x, _mm256_set1_pd(Log2e)),
+        _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m256d r = _mm256_fnmadd_pd(n, _mm256_set1_pd(Ln2Hi), x);
+    r = _mm256_fnmadd_pd(n, _mm256_set1_pd(Ln2Lo), r);
+
+    __m256d p = _mm256_set1_pd(ExpCoeffs[0]);
+    for (size_t k = 1; k < NumExpCoeffs; ++k)
+        p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(ExpCoeffs[k]));
+
+    // Build 2^n directly: adding 1.5 * 2^52 leaves n in the low mantissa
+    // bits, which are then moved into the exponent.
+    __m256d t = _mm256_add_pd(n, _mm256_set1_pd(6755399441055744.0));
+    __m256i e = _mm256_slli_epi64(_mm256_add_epi64(_mm256_castpd_si256(t),
+        _mm256_set1_epi64x(1023)), 52);
+    return _mm256_and_pd(_mm256_mul_pd(p, _mm256_castsi256_pd(e)), live);
+}
+
+
+__attribute__((target("avx2,fma")))
+inline double hsum256(__m256d v)
+{
+    __m128d s = _mm_add_pd(_mm256_castpd256_pd128(v),
+        _mm256_extractf128_pd(v, 1));
+    return _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s)));
+}
+
+
+__attribute__((target("avx2,fma")))
+double affinityAvx2(const double *fixed, size_t n, const double *moving,
+    size_t m, double sigma2, double outliers, double *p1, double *pt1,
+    double *px, double *work)
+{
+    const double *mx = moving;
+    const double *my = moving + m;
+    const double *mz = moving + 2 * m;
+    double *pxx = px;
+    double *pxy = px + m;
+    double *pxz = px + 2 * m;
+    const double ksig = -2.0 * sigma2;
+    const double outlierTmp = outlierTerm(n, m, sigma2, outliers);
+    const size_t mv = m - m % 4;
+    const __m256d invKsig = _mm256_set1_pd(1.0 / ksig);
+
+    std::fill(p1, p1 + m, 0.0);
+    std::fill(px, px + 3 * m, 0.0);
+    double l = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+        double x = fixed[i];
+        double y = fixed[n + i];
+        double z = fixed[2 * n + i];
+        __m256d xv = _mm256_set1_pd(x);
+        __m256d yv = _mm256_set1_pd(y);
+        __m256d zv = _mm256_set1_pd(z);
+
+        __m256d sum = _mm256_setzero_pd();
+        size_t j = 0;
+        for (; j < mv; j += 4)
+        {
+            __m256d dx = _mm256_sub_pd(xv, _mm256_loadu_pd(mx + j));
+            __m256d dy = _mm256_sub_pd(yv, _mm256_loadu_pd(my + j));
+            __m256d dz = _mm256_sub_pd(zv, _mm256_loadu_pd(mz + j));
+            __m256d d = _mm256_mul_pd(dx, dx);
+            d = _mm256_fmadd_pd(dy, dy, d);
+            d = _mm256_fmadd_pd(dz, dz, d);
+            __m256d p = exp256(_mm256_mul_pd(d, invKsig));
+            _mm256_storeu_pd(work + j, p);
+            sum = _mm256_add_pd(sum, p);
+        }
+        double sp = hsum256(sum);
+        for (; j < m; ++j)
+        {
+            double dx = x - mx[j];
+            double dy = y - my[j];
+            double dz = z - mz[j];
+            work[j] = std::exp((dx * dx + dy * dy + dz * dz) / ksig);
+            sp += work[j];
+        }
+        sp += outlierTmp;
+        pt1[i] = 1 - outlierTmp / sp;
+
+        double inv = 1.0 / sp;
+        __m256d iv = _mm256_set1_pd(inv);
+        for (j = 0; j < mv; j += 4)
+        {
+            __m256d w = _mm256_mul_pd(_mm256_loadu_pd(work + j), iv);
+            _mm256_storeu_pd(p1 + j, _mm256_add_pd(_mm256_loadu_pd(p1 + j), w));
+            _mm256_storeu_pd(pxx + j,
+                _mm256_fmadd_pd(xv, w, _mm256_loadu_pd(pxx + j)));
+            _mm256_storeu_pd(pxy + j,
+                _mm256_fmadd_pd(yv, w, _mm256_loadu_pd(pxy + j)));
+            _mm256_storeu_pd(pxz + j,
+                _mm256_fmadd_pd(zv, w, _mm256_loadu_pd(pxz + j)));
+        }
+        for (; j < m; ++j)
+        {
+            double w = work[j] * inv;
+            p1[j] += w;
+            pxx[j] += x * w;
+            pxy[j] += y * w;
+            pxz[j] += z * w;
+        }
+        l -= std::log(sp);
+    }
+    return l + 3 * n * std::log(sigma2) / 2;
+}
+
+
+// GCC's AVX-512 headers pass undefined vectors as the unused operands of
+// some intrinsics, which -Wmaybe-uninitialized reports once they're inlined.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+__attribute__((target("avx512f")))
+inline __m512d exp512(__m512d x)
+{
+    __mmask8 live = _mm512_cmp_pd_mask(x, _mm512_set1_pd(ExpMin), _CMP_GE_OQ);
+    x = _mm512_max_pd(x, _mm512_set1_pd(ExpMin));
+    __m512d n = _mm512_roundscale_pd(_mm512_mul_pd(x, _mm512_set1_pd(Log2e)),
+        _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m512d r = _mm512_fnmadd_pd(n, _mm512_set1_pd(Ln2Hi), x);
+    r = _mm512_fnmadd_pd(n, _mm512_set1_pd(Ln2Lo), r);
+
+    __m512d p = _mm512_set1_pd(ExpCoeffs[0]);
+    for (size_t k = 1; k < NumExpCoeffs; ++k)
+        p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(ExpCoeffs[k]));
+    return _mm512_maskz_mov_pd(live, _mm512_scalef_pd(p, n));
+}
+
+
+__attribute__((target("avx512f")))
+double affinityAvx512(const double *fixed, size_t n, const double *moving,
+    size_t m, double sigma2, double outliers, double *p1, double *pt1,
+    double *px, double *work)
+{
+    const double *mx = moving;
+    const double *my = moving + m;
+    const double *mz = moving + 2 * m;
+    double *pxx = px;
+    double *pxy = px + m;
+    double *pxz = px + 2 * m;
+    const double ksig = -2.0 * sigma2;
+    const double outlierTmp = outlierTerm(n, m, sigma2, outliers);
+    const __m512d invKsig = _mm512_set1_pd(1.0 / ksig);
+
+    std::fill(p1, p1 + m, 0.0);
+    std::fill(px, px + 3 * m, 0.0);
+    double l = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+        double x = fixed[i];
+        double y = fixed[n + i];
+        double z = fixed[2 * n + i];
+        __m512d xv = _mm512_set1_pd(x);
+        __m512d yv = _mm512_set1_pd(y);
+        __m512d zv = _mm512_set1_pd(z);
+
+        // The tail is handled with masks. Masked-off lanes are zeroed
+        // after the exponential so they don't contribute to the sum.
+        __m512d sum = _mm512_setzero_pd();
+        for (size_t j = 0; j < m; j += 8)
+        {
+            __mmask8 k = (m - j >= 8) ? 0xFF : (__mmask8)((1u << (m - j)) - 1);
+            __m512d dx = _mm512_sub_pd(xv, _mm512_maskz_loadu_pd(k, mx + j));
+            __m512d dy = _mm512_sub_pd(yv, _mm512_maskz_loadu_pd(k, my + j));
+            __m512d dz = _mm512_sub_pd(zv, _mm512_maskz_loadu_pd(k, mz + j));
+            __m512d d = _mm512_mul_pd(dx, dx);
+            d = _mm512_fmadd_pd(dy, dy, d);
+            d = _mm512_fmadd_pd(dz, dz, d);
+            __m512d p = _mm512_maskz_mov_pd(k,
+                exp512(_mm512_mul_pd(d, invKsig)));
+            _mm512_mask_storeu_pd(work + j, k, p);
+            sum = _mm512_add_pd(sum, p);
+        }
+        double sp = _mm512_reduce_add_pd(sum) + outlierTmp;
+        pt1[i] = 1 - outlierTmp / sp;
+
+        __m512d iv = _mm512_set1_pd(1.0 / sp);
+        for (size_t j = 0; j < m; j += 8)
+        {
+            __mmask8 k = (m - j >= 8) ? 0xFF : (__mmask8)((1u << (m - j)) - 1);
+            __m512d w = _mm512_mul_pd(_mm512_maskz_loadu_pd(k, work + j), iv);
+            _mm512_mask_storeu_pd(p1 + j, k,
+                _mm512_add_pd(_mm512_maskz_loadu_pd(k, p1 + j), w));
+            _mm512_mask_storeu_pd(pxx + j, k,
+                _mm512_fmadd_pd(xv, w, _mm512_maskz_loadu_pd(k, pxx + j)));
+            _mm512_mask_storeu_pd(pxy + j, k,
+                _mm512_fmadd_pd(yv, w, _mm512_maskz_loadu_pd(k, pxy + j)));
+            _mm512_mask_storeu_pd(pxz + j, k,
+                _mm512_fmadd_pd(zv, w, _mm512_maskz_loadu_pd(k, pxz + j)));
+        }
+        l -= std::log(sp);
+    }
+    return l + 3 * n * std::log(sigma2) / 2;
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+// Single precision. Taylor coefficients 1/7! ... 1/0!, for a truncation
+// error below 1e-8 over the reduced range.
+const float ExpCoeffsF[] =
+{
+    1.0f / 5040.0f, 1.0f / 720.0f, 1.0f / 120.0f, 1.0f / 24.0f, 1.0f / 6.0f,
+    0.5f, 1.0f, 1.0f
+};
+const size_t NumExpCoeffsF = sizeof(ExpCoeffsF) / sizeof(ExpCoeffsF[0]);
+
+const float Ln2HiF = 6.93359375e-1f;
+const float Ln2LoF = -2.12194440e-4f;
+const float Log2eF = 1.44269504f;
+// exp(-87) is just above the smallest normal float.
+const float ExpMinF = -87.0f;
+
+__attribute__((target("avx2,fma")))
+inline __m256 exp256f(__m256 x)
+{
+    __m256 live = _mm256_cmp_ps(x, _mm256_set1_ps(ExpMinF), _CMP_GE_OQ);
+    x = _mm256_max_ps(x, _mm256_set1_ps(ExpMinF));
+    __m256 n = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(Log2eF)),
+        _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m256 r = _mm256_fnmadd_ps(n, _mm256_set1_ps(Ln2HiF), x);
+    r = _mm256_fnmadd_ps(n, _mm256_set1_ps(Ln2LoF), r);
+
+    __m256 p = _mm256_set1_ps(ExpCoeffsF[0]);
+    for (size_t k = 1; k < NumExpCoeffsF; ++k)
+        p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(ExpCoeffsF[k]));
+
+    // As exp256(), with 1.5 * 2^23.
+    __m256 t = _mm256_add_ps(n, _mm256_set1_ps(12582912.0f));
+    __m256i e = _mm256_slli_epi32(_mm256_add_epi32(_mm256_castps_si256(t),
+        _mm256_set1_epi32(127)), 23);
+    return _mm256_and_ps(_mm256_mul_ps(p, _mm256_castsi256_ps(e)), live);
+}
+
+
+// Add the values of 'v' to 'sum' in double precision.
+__attribute__((target("avx2,fma")))
+inline __m256d accumulate256f(__m256d sum, __m256 v)
+{
+    sum = _mm256_add_pd(sum, _mm256_cvtps_pd(_mm256_castps256_ps128(v)));
+    return _mm256_add_pd(sum, _mm256_cvtps_pd(_mm256_extractf128_ps(v, 1)));
+}
+
+
+__attribute__((target("avx2,fma")))
+double affinityAvx2f(const float *fixed, size_t n, const float *moving,
+    size_t m, double sigma2, double outliers, float *p1, float *pt1,
+    float *px, float *work)
+{
+    const float *mx = moving;
+    const float *my = moving + m;
+    const float *mz = moving + 2 * m;
+    float *pxx = px;
+    float *pxy = px + m;
+    float *pxz = px + 2 * m;
+    const float ksig = float(-2.0 * sigma2);
+    const double outlierTmp = outlierTerm(n, m, sigma2, outliers);
+    const size_t mv = m - m % 8;
+    const __m256 invKsig = _mm256_set1_ps(float(1.0 / (-2.0 * sigma2)));
+
+    std::fill(p1, p1 + m, 0.0f);
+    std::fill(px, px + 3 * m, 0.0f);
+    double l = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+        float x = fixed[i];
+        float y = fixed[n + i];
+        float z = fixed[2 * n + i];
+        __m256 xv = _mm256_set1_ps(x);
+        __m256 yv = _mm256_set1_ps(y);
+        __m256 zv = _mm256_set1_ps(z);
+
+        __m256d sum = _mm256_setzero_pd();
+        size_t j = 0;
+        for (; j < mv; j += 8)
+        {
+            __m256 dx = _mm256_sub_ps(xv, _mm256_loadu_ps(mx + j));
+            __m256 dy = _mm256_sub_ps(yv, _mm256_loadu_ps(my + j));
+            __m256 dz = _mm256_sub_ps(zv, _mm256_loadu_ps(mz + j));
+            __m256 d = _mm256_mul_ps(dx, dx);
+            d = _mm256_fmadd_ps(dy, dy, d);
+            d = _mm256_fmadd_ps(dz, dz, d);
+            __m256 p = exp256f(_mm256_mul_ps(d, invKsig));
+            _mm256_storeu_ps(work + j, p);
+            sum = accumulate256f(sum, p);
+        }
+        double sp = hsum256(sum);
+        for (; j < m; ++j)
+        {
+            float dx = x - mx[j];
+            float dy = y - my[j];
+            float dz = z - mz[j];
+            work[j] = std::exp((dx * dx + dy * dy + dz * dz) / ksig);
+            sp += work[j];
+        }
+        sp += outlierTmp;
+        pt1[i] = float(1 - outlierTmp / sp);
+
+        float inv = float(1.0 / sp);
+        __m256 iv = _mm256_set1_ps(inv);
+        for (j = 0; j < mv; j += 8)
+        {
+            __m256 w = _mm256_mul_ps(_mm256_loadu_ps(work + j), iv);
+            _mm256_storeu_ps(p1 + j, _mm256_add_ps(_mm256_loadu_ps(p1 + j), w));
+            _mm256_storeu_ps(pxx + j,
+                _mm256_fmadd_ps(xv, w, _mm256_loadu_ps(pxx + j)));
+            _mm256_storeu_ps(pxy + j,
+                _mm256_fmadd_ps(yv, w, _mm256_loadu_ps(pxy + j)));
+            _mm256_storeu_ps(pxz + j,
+                _mm256_fmadd_ps(zv, w, _mm256_loadu_ps(pxz + j)));
+        }
+        for (; j < m; ++j)
+        {
+            float w = work[j] * inv;
+            p1[j] += w;
+            pxx[j] += x * w;
+            pxy[j] += y * w;
+            pxz[j] += z * w;
+        }
+        l -= std::log(sp);
+    }
+    return l + 3 * n * std::log(sigma2) / 2;
+}
+
+
+// As above, for the undefined operands of the AVX-512 intrinsics.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+__attribute__((target("avx512f")))
+inline __m512 exp512f(__m512 x)
+{
+    __mmask16 live = _mm512_cmp_ps_mask(x, _mm512_set1_ps(ExpMinF),
+        _CMP_GE_OQ);
+    x = _mm512_max_ps(x, _mm512_set1_ps(ExpMinF));
+    __m512 n = _mm512_roundscale_ps(_mm512_mul_ps(x, _mm512_set1_ps(Log2eF)),
+        _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m512 r = _mm512_fnmadd_ps(n, _mm512_set1_ps(Ln2HiF), x);
+    r = _mm512_fnmadd_ps(n, _mm512_set1_ps(Ln2LoF), r);
+
+    __m512 p = _mm512_set1_ps(ExpCoeffsF[0]);
+    for (size_t k = 1; k < NumExpCoeffsF; ++k)
+        p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(ExpCoeffsF[k]));
+    return _mm512_maskz_mov_ps(live, _mm512_scalef_ps(p, n));
+}
+
+
+// As accumulate256f().
+__attribute__((target("avx512f")))
+inline __m512d accumulate512f(__m512d sum, __m512 v)
+{
+    sum = _mm512_add_pd(sum, _mm512_cvtps_pd(_mm512_castps512_ps256(v)));
+    return _mm512_add_pd(sum, _mm512_cvtps_pd(_mm256_castpd_ps(
+        _mm512_extractf64x4_pd(_mm512_castps_pd(v), 1))));
+}
+
+
+__attribute__((target("avx512f")))
+double affinityAvx512f(const float *fixed, size_t n, const float *moving,
+    size_t m, double sigma2, double outliers, float *p1, float *pt1,
+    float *px, float *work)
+{
+    const float *mx = moving;
+    const float *my = moving + m;
+    const float *mz = moving + 2 * m;
+    float *pxx = px;
+    float *pxy = px + m;
+    float *pxz = px + 2 * m;
+    const double outlierTmp = outlierTerm(n, m, sigma2, outliers);
+    const __m512 invKsig = _mm512_set1_ps(float(1.0 / (-2.0 * sigma2)));
+
+    std::fill(p1, p1 + m, 0.0f);
+    std::fill(px, px + 3 * m, 0.0f);
+    double l = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+        __m512 xv = _mm512_set1_ps(fixed[i]);
+        __m512 yv = _mm512_set1_ps(fixed[n + i]);
+        __m512 zv = _mm512_set1_ps(fixed[2 * n + i]);
+
+        __m512d sum = _mm512_setzero_pd();
+        for (size_t j = 0; j < m; j += 16)
+        {
+            __mmask16 k = (m - j >= 16) ? 0xFFFF :
+                (__mmask16)((1u << (m - j)) - 1);
+            __m512 dx = _mm512_sub_ps(xv, _mm512_maskz_loadu_ps(k, mx + j));
+            __m512 dy = _mm512_sub_ps(yv, _mm512_maskz_loadu_ps(k, my + j));
+            __m512 dz = _mm512_sub_ps(zv, _mm512_maskz_loadu_ps(k, mz + j));
+            __m512 d = _mm512_mul_ps(dx, dx);
+            d = _mm512_fmadd_ps(dy, dy, d);
+            d = _mm512_fmadd_ps(dz, dz, d);
+            __m512 p = _mm512_maskz_mov_ps(k,
+                exp512f(_mm512_mul_ps(d, invKsig)));
+            _mm512_mask_storeu_ps(work + j, k, p);
+            sum = accumulate512f(sum, p);
+        }
+        double sp = _mm512_reduce_add_pd(sum) + outlierTmp;
+        pt1[i] = float(1 - outlierTmp / sp);
+
+        __m512 iv = _mm512_set1_ps(float(1.0 / sp));
+        for (size_t j = 0; j < m; j += 16)
+        {
+            __mmask16 k = (m - j >= 16) ? 0xFFFF :
+                (__mmask16)((1u << (m - j)) - 1);
+            __m512 w = _mm512_mul_ps(_mm512_maskz_loadu_ps(k, work + j), iv);
+            _mm512_mask_storeu_ps(p1 + j, k,
+                _mm512_add_ps(_mm512_maskz_loadu_ps(k, p1 + j), w));
+            _mm512_mask_storeu_ps(pxx + j, k,
+                _mm512_fmadd_ps(xv, w, _mm512_maskz_loadu_ps(k, pxx + j)));
+            _mm512_mask_storeu_ps(pxy + j, k,
+                _mm512_fmadd_ps(yv, w, _mm512_maskz_loadu_ps(k, pxy + j)));
+            _mm512_mask_storeu_ps(pxz + j, k,
+                _mm512_fmadd_ps(zv, w, _mm512_maskz_loadu_ps(k, pxz + j)));
+        }
+        l -= std::log(sp);
+    }
+    return l + 3 * n * std::log(sigma2) / 2;
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+#endif // ATLAS_X86_SIMD
+
+Kernel selectKernel()
+{
+    const char *env = std::getenv("ATLAS_SIMD");
+    std::string force(env ? env : "");
+
+#ifdef ATLAS_X86_SIMD
+    __builtin_cpu_init();
+    if (force != "avx2" && force != "scalar" &&
+            __builtin_cpu_supports("avx512f"))
+        return { "avx512", affinityAvx512, affinityAvx512f };
+    if (force != "scalar" && __builtin_cpu_supports("avx2") &&
+            __builtin_cpu_supports("fma"))
+        return { "avx2", affinityAvx2, affinityAvx2f };
+#endif
+    return { "scalar", affinityScalar<double>, affinityScalar<float> };
+}
+
+
+const Kernel& kernel()
+{
+    static const Kernel k = selectKernel();
+    return k;
+}
+
+} // unnamed namespace
+
+double gaussAffinity(const double *fixed, size_t n, const double *moving,
+    size_t m, double sigma2, double outliers, double *p1, double *pt1,
+    double *px, double *work)
+{
+    return kernel().fn(fixed, n, moving, m, sigma2, outliers, p1, pt1, px,
+        work);
+}
+
+
+double gaussAffinity(const float *fixed, size_t n, const float *moving,
+    size_t m, double sigma2, double outliers, float *p1, float *pt1,
+    float *px, float *work)
+{
+    return kernel().floatFn(fixed, n, moving, m, sigma2, outliers, p1, pt1,
+        px, work);
+}
+
+
+double gaussAffinityReference(const double *fixed, size_t n,
+    const double *moving, size_t m, double sigma2, double outliers,
+    double *p1, double *pt1, double *px, double *work)
+{
+    return affinityScalar(fixed, n, moving, m, sigma2, outliers, p1, pt1,
+        px, work);
+}
+
+
+double gaussAffinityReference(const float *fixed, size_t n,
+    const float *moving, size_t m, double sigma2, double outliers,
+    float *p1, float *pt1, float *px, float *work)
+{
+    return affinityScalar(fixed, n, moving, m, sigma2, outliers, p1, pt1,
+        px, work);
+}
+
+
+const char *gaussAffinityKernel()
+{
+    return kernel().name;
+}
+
+} // namespace AtlasProcessor
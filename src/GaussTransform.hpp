@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstddef>
+
+namespace AtlasProcessor
+{
+
+// Direct (O(N * M)) computation of the CPD E-step for 3D point sets.
+//
+// 'fixed' (N x 3) and 'moving' (M x 3) are column-major, as is 'px' (M x 3).
+// 'p1' (M), 'pt1' (N) and 'px' are overwritten. 'work' must hold M values.
+// Returns the negative log-likelihood, as cpd::Probabilities::l.
+//
+// The kernel is vectorized with AVX2/FMA or AVX-512 when the CPU supports
+// them, selected at runtime, and falls back to scalar code otherwise. The
+// vectorized exponential has a relative error below 1e-14 over the range
+// used, and summation order differs from the scalar code, so results match
+// cpd::GaussTransformDirect to within a relative tolerance of 1e-12.
+// Affinities below exp(-700) are flushed to zero.
+double gaussAffinity(const double *fixed, size_t n, const double *moving,
+    size_t m, double sigma2, double outliers, double *p1, double *pt1,
+    double *px, double *work);
+
+// As above, in single precision, for coordinates near the origin (e.g.
+// normalized). Each row's sum and the log-likelihood are accumulated in
+// double. The vectorized kernels handle twice as many points per
+// instruction as those above; their exponential has a relative error
+// below 1e-6 and affinities below exp(-87) are flushed to zero.
+double gaussAffinity(const float *fixed, size_t n, const float *moving,
+    size_t m, double sigma2, double outliers, float *p1, float *pt1,
+    float *px, float *work);
+
+// The scalar kernel, whatever the CPU, as a reference against which to
+// check the vectorized ones.
+double gaussAffinityReference(const double *fixed, size_t n,
+    const double *moving, size_t m, double sigma2, double outliers,
+    double *p1, double *pt1, double *px, double *work);
+double gaussAffinityReference(const float *fixed, size_t n,
+    const float *moving, size_t m, double sigma2, double outliers,
+    float *p1, float *pt1, float *px, float *work);
+
+// Name of the kernel selected for this CPU ("avx512", "avx2" or "scalar").
+// The environment variable ATLAS_SIMD can be set to one of these values to
+// force a less capable kernel.
+const char *gaussAffinityKernel();
+
+} // namespace AtlasProcessor
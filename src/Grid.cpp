@@ -1,247 +1,1225 @@
 
-#include <cpd/rigid.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <sstream>
 
+#include "Bootstrap.hpp"
 #include "Grid.hpp"
+#include "Regularize.hpp"
 
 namespace AtlasProcessor
 {
 
-void Grid::insert(pdal::PointViewPtr in, AP::Order order)
+namespace
+{
+
+// A cell registered as the quadrants of a quadtree (see Grid::split()).
+struct SplitCell
+{
+    GridCell *cell;
+    std::vector<GridCell> parts;
+    // Parts still being registered.
+    std::atomic<size_t> remaining;
+};
+
+
+// Whether the indexes of the halves of cell index 'i', 2i and 2i + 1, fit
+// in an int.
+bool halvable(int i)
+{
+    return i >= (std::numeric_limits<int>::min)() / 2 &&
+        i <= ((std::numeric_limits<int>::max)() - 1) / 2;
+}
+
+
+// Whether every point of 'node' has the same X and Y, so that no split can
+// separate them.
+bool coincident(const GridCell& node)
+{
+    const PointList& first = node.m_before.size() ? node.m_before :
+        node.m_after;
+    if (first.empty())
+        return true;
+    Eigen::Vector2d xy = first.front().head<2>();
+    for (const PointList *points : { &node.m_before, &node.m_after })
+        for (const Eigen::Vector3d& p : *points)
+            if (p.head<2>() != xy)
+                return false;
+    return true;
+}
+
+
+// Split 'node' into quadrants, and those into quadrants, until each has no
+// more than opts.maxPoints points in either scene or 'levels' is used up.
+// Nodes whose quadrants' indexes would overflow, or whose points can't be
+// separated, aren't split. The node's points are moved into the leaves,
+// which are moved to 'leaves'.
+void quarter(GridCell& node, int levels, const RegistrationOptions& opts,
+    std::vector<GridCell>& leaves)
+{
+    if (levels == 0 || (node.m_before.size() <= opts.maxPoints &&
+            node.m_after.size() <= opts.maxPoints) ||
+            !halvable(node.m_x) || !halvable(node.m_y) || coincident(node))
+    {
+        leaves.push_back(std::move(node));
+        return;
+    }
+
+    double len = node.m_len / 2;
+    std::vector<GridCell> parts;
+    for (int j = 0; j < 2; ++j)
+        for (int i = 0; i < 2; ++i)
+            parts.emplace_back(2 * node.m_x + i, 2 * node.m_y + j, len);
+    // Clamped before conversion, as points on the node's edges may round
+    // into its neighbours.
+    auto quadrant = [&node, len](const Eigen::Vector3d& p)
+    {
+        double i = std::floor(p(0) / len) - 2.0 * node.m_x;
+        double j = std::floor(p(1) / len) - 2.0 * node.m_y;
+        return int((std::min)((std::max)(j, 0.0), 1.0)) * 2 +
+            int((std::min)((std::max)(i, 0.0), 1.0));
+    };
+
+    // The parts' lists are sized exactly, so that together they take no
+    // more memory than the node's.
+    size_t counts[2][4] = {};
+    for (const Eigen::Vector3d& p : node.m_before)
+        counts[0][quadrant(p)]++;
+    for (const Eigen::Vector3d& p : node.m_after)
+        counts[1][quadrant(p)]++;
+    for (int k = 0; k < 4; ++k)
+    {
+        parts[k].m_before.reserve(counts[0][k]);
+        parts[k].m_after.reserve(counts[1][k]);
+    }
+    for (const Eigen::Vector3d& p : node.m_before)
+        parts[quadrant(p)].m_before.push_back(p);
+    for (const Eigen::Vector3d& p : node.m_after)
+        parts[quadrant(p)].m_after.push_back(p);
+    node.release();
+
+    for (GridCell& part : parts)
+        quarter(part, levels - 1, opts, leaves);
+}
+
+} // unnamed namespace
+
+
+void Grid::insert(pdal::PointViewPtr in, AP::Order order,
+    const PointFilter& filter)
 {
     using namespace pdal;
     using namespace pdal::Dimension;
 
+    std::vector<Id> dims;
+    if (filter.usesClass())
+        dims.push_back(Id::Classification);
+    if (filter.usesReturns())
+    {
+        dims.push_back(Id::ReturnNumber);
+        dims.push_back(Id::NumberOfReturns);
+    }
+    if (filter.usesIntensity())
+        dims.push_back(Id::Intensity);
+    for (Id dim : dims)
+        if (!in->hasDim(dim))
+            throw pdal_error("Can't filter on " + Dimension::name(dim) +
+                ", which the input doesn't have.");
+
     for (PointId id = 0; id < in->size(); ++id)
     {
+        if (filter.active() &&
+            !filter.keep(in->getFieldAs<int>(Id::Classification, id),
+                in->getFieldAs<int>(Id::ReturnNumber, id),
+                in->getFieldAs<int>(Id::NumberOfReturns, id),
+                in->getFieldAs<double>(Id::Intensity, id)))
+            continue;
         double x = in->getFieldAs<double>(Id::X, id);
         double y = in->getFieldAs<double>(Id::Y, id);
         double z = in->getFieldAs<double>(Id::Z, id);
-        int ix = int(std::floor(x / m_len));
-        int iy = int(std::floor(y / m_len));
+        insert(x, y, z, order);
+    }
+}
 
-        GridIndex index(ix, iy);
-        auto ci = m_cells.find(index);
-        if (ci == m_cells.end())
+
+void Grid::insert(double x, double y, double z, AP::Order order)
+{
+    int ix = int(std::floor(x / m_len));
+    int iy = int(std::floor(y / m_len));
+
+    if (m_pipelined)
+        advance(iy);
+
+    GridCell& cell = findCell(ix, iy);
+    PointList& out = (order == Order::Before ? cell.m_before : cell.m_after);
+    size_t capacity = out.capacity();
+    out.emplace_back(x, y, z);
+    m_points++;
+    if (out.capacity() != capacity)
+        grown((out.capacity() - capacity) * sizeof(Eigen::Vector3d));
+}
+
+
+void Grid::insert(const double *xyz, size_t count, AP::Order order)
+{
+    const size_t offsets[] { 0, sizeof(double), 2 * sizeof(double) };
+
+    insert(reinterpret_cast<const char *>(xyz), count, 3 * sizeof(double),
+        offsets, order);
+}
+
+
+// Points are handled a block at a time. The coordinates of a block are
+// gathered into columns and their cell indices computed in loops the
+// compiler can vectorize. Then each run of points that fall in the same
+// cell, which is most of them in scan-ordered input, is appended with a
+// single cell lookup.
+void Grid::insert(const char *data, size_t count, size_t stride,
+    const size_t offsets[3], AP::Order order, int rowBegin, int rowEnd)
+{
+    const size_t BlockSize = 1024;
+    double pos[3][BlockSize];
+    int ix[BlockSize];
+    int iy[BlockSize];
+
+    for (size_t start = 0; start < count; start += BlockSize)
+    {
+        size_t n = (std::min)(BlockSize, count - start);
+
+        for (size_t d = 0; d < 3; ++d)
         {
-            GridCell cell(m_table, ix, iy, m_len, in);
-            ci = m_cells.insert(std::make_pair(index, cell)).first;
+            const char *p = data + start * stride + offsets[d];
+            for (size_t i = 0; i < n; ++i, p += stride)
+                std::memcpy(&pos[d][i], p, sizeof(double));
+        }
+        for (size_t i = 0; i < n; ++i)
+        {
+            ix[i] = int(std::floor(pos[0][i] / m_len));
+            iy[i] = int(std::floor(pos[1][i] / m_len));
+        }
+
+        size_t i = 0;
+        while (i < n)
+        {
+            size_t j = i + 1;
+            while (j < n && ix[j] == ix[i] && iy[j] == iy[i])
+                j++;
+            if (iy[i] >= rowBegin && iy[i] < rowEnd)
+            {
+                if (m_pipelined)
+                    advance(iy[i]);
+
+                GridCell& cell = findCell(ix[i], iy[i]);
+                PointList& out =
+                    (order == Order::Before ? cell.m_before : cell.m_after);
+                size_t capacity = out.capacity();
+                for (size_t k = i; k < j; ++k)
+                    out.emplace_back(pos[0][k], pos[1][k], pos[2][k]);
+                m_points += j - i;
+                if (out.capacity() != capacity)
+                    grown((out.capacity() - capacity) *
+                        sizeof(Eigen::Vector3d));
+            }
+            i = j;
         }
-        GridCell& cell = ci->second;
-        PointViewPtr& out = (order == Order::Before ?
-            cell.m_before : cell.m_after);
-        PointId idx = out->size();
-        out->setField(Id::X, idx, x);
-        out->setField(Id::Y, idx, y);
-        out->setField(Id::Z, idx, z);
     }
 }
 
 
-void Grid::calcLimits()
+GridCell& Grid::findCell(int x, int y)
+{
+    if (m_lastCell && m_lastCell->m_x == x && m_lastCell->m_y == y)
+        return *m_lastCell;
+
+    GridIndex index(x, y);
+    auto ci = m_cells.find(index);
+    if (ci == m_cells.end())
+    {
+        ci = m_cells.insert(std::make_pair(index, GridCell(x, y, m_len))).first;
+        m_cellCount++;
+        m_xMin = (std::min)(m_xMin, x);
+        m_xMax = (std::max)(m_xMax, x);
+        m_yMin = (std::min)(m_yMin, y);
+        m_yMax = (std::max)(m_yMax, y);
+        if (m_pipelined)
+            m_openRows[y].push_back(&ci->second);
+    }
+    m_lastCell = &ci->second;
+    m_lastCell->m_touched = ++m_clock;
+    return *m_lastCell;
+}
+
+
+void Grid::setMemoryLimit(size_t bytes, const std::string& dir)
 {
-    int xmin = (std::numeric_limits<int>::max)();
-    int xmax = (std::numeric_limits<int>::lowest)();
-    int ymin = (std::numeric_limits<int>::max)();
-    int ymax = (std::numeric_limits<int>::lowest)();
+    m_memoryLimit = bytes;
+    if (bytes && !m_spill)
+        m_spill.reset(new SpillFile(dir));
+}
+
+
+// Account for cells' point lists having grown by 'bytes' on insertion.
+void Grid::grown(size_t bytes)
+{
+    m_held += bytes;
+    if (m_memoryLimit && m_held > m_memoryLimit)
+        evict();
+}
+
+
+// Spill the cells that have gone longest without new points until half of
+// the limit is free, so that spills are infrequent. Cells that have been
+// submitted belong to the workers and are left alone.
+void Grid::evict()
+{
+    std::vector<GridCell *> cells;
     for (auto& cellPair : m_cells)
     {
-        const GridIndex& idx = cellPair.first;
-        int x = idx.x();
-        int y = idx.y();
-        xmin = (std::min)(xmin, x);
-        xmax = (std::max)(xmax, x);
-        ymin = (std::min)(ymin, y);
-        ymax = (std::max)(ymax, y);
+        GridCell& cell = cellPair.second;
+        if (!cell.m_submitted && cell.bytes())
+            cells.push_back(&cell);
+    }
+    std::sort(cells.begin(), cells.end(),
+        [](const GridCell *a, const GridCell *b)
+        { return a->m_touched < b->m_touched; });
+    for (GridCell *cell : cells)
+    {
+        if (m_held <= m_memoryLimit / 2)
+            break;
+        spill(*cell);
     }
-    m_xOrigin = xmin;
-    m_yOrigin = ymin;
-    m_xSize = xmax - xmin + 1;
-    m_ySize = ymax - ymin + 1;
 }
 
 
-void Grid::registration(int minpts, bool debug)
+// Move a cell's points to the spill file.
+void Grid::spill(GridCell& cell)
 {
+    size_t bytes = cell.bytes();
+    if (bytes == 0)
+        return;
+
+    if (cell.m_before.size())
+        cell.m_spilled[0].push_back(m_spill->write(cell.m_before));
+    if (cell.m_after.size())
+        cell.m_spilled[1].push_back(m_spill->write(cell.m_after));
+    cell.release();
+    m_held -= bytes;
+}
+
+
+// Read any of a cell's points that were spilled back into memory, ahead of
+// those inserted since. Returns the bytes by which the cell's point lists
+// grew.
+size_t Grid::load(GridCell& cell)
+{
+    size_t bytes = cell.bytes();
+    for (int i = 0; i < 2; ++i)
+    {
+        std::vector<SpillFile::Extent>& extents = cell.m_spilled[i];
+        if (extents.empty())
+            continue;
+
+        PointList& list = (i == 0 ? cell.m_before : cell.m_after);
+        PointList points;
+        points.reserve(cell.count(i == 0 ? Order::Before : Order::After));
+        for (const SpillFile::Extent& e : extents)
+            m_spill->read(e, points);
+        points.insert(points.end(), list.begin(), list.end());
+        list.swap(points);
+        extents.clear();
+    }
+    size_t loaded = cell.bytes();
+    m_held += loaded;
+    m_held -= bytes;
+    return loaded > bytes ? loaded - bytes : 0;
+}
+
+
+// Memory needed to register 'cell' beyond what's held (see m_held): the
+// engine's copies of its points, and any of its points that are spilled
+// until they're loaded (see Admission::loaded()).
+size_t Grid::workingBytes(const GridCell& cell) const
+{
+    size_t spilled = 0;
+    for (int i = 0; i < 2; ++i)
+        for (const SpillFile::Extent& e : cell.m_spilled[i])
+            spilled += e.count;
+    return (cell.count(Order::Before) + cell.count(Order::After) + spilled) *
+        sizeof(Eigen::Vector3d);
+}
+
+
+// Wait until a registration needing 'bytes' fits within the memory limit
+// along with those under way, or until none are.
+void Grid::admit(size_t bytes)
+{
+    if (!m_memoryLimit)
+        return;
+
+    std::unique_lock<std::mutex> lock(m_memoryMutex);
+    m_memoryFreed.wait(lock, [this, bytes]()
+        { return m_working == 0 ||
+            m_held + m_working + bytes <= m_memoryLimit; });
+    m_working += bytes;
+}
+
+
+void Grid::discharge(size_t bytes)
+{
+    if (!m_memoryLimit)
+        return;
+
+    std::lock_guard<std::mutex> lock(m_memoryMutex);
+    m_working -= bytes;
+    m_memoryFreed.notify_all();
+}
+
+
+// The extent is tracked as cells are created, since registered cells have
+// been erased.
+void Grid::calcLimits()
+{
+    m_xOrigin = m_xMin;
+    m_yOrigin = m_yMin;
+    m_xSize = m_xMax - m_xMin + 1;
+    m_ySize = m_yMax - m_yMin + 1;
+}
+
+
+void Grid::registration(const RegistrationOptions& opts)
+{
+    m_opts = opts;
+    if (m_opts.adaptiveLevels > 0)
+        mergeSparse();
     for (auto ci = m_cells.begin(); ci != m_cells.end(); ++ci)
+        if (!ci->second.m_submitted)
+            submit(ci->second);
+    flush();
+    await();
+    reap();
+}
+
+
+void Grid::startPipeline(const RegistrationOptions& opts, int band)
+{
+    // Blocks of merged cells may span rows that close at different times.
+    if (opts.adaptiveLevels > 0)
+        throw pdal::pdal_error("Adaptive cells can't be pipelined.");
+    m_pipelined = true;
+    m_opts = opts;
+    m_band = (std::max)(band, 0);
+    m_sweep = 0;
+    m_firstRow = (std::numeric_limits<int>::lowest)();
+    m_frontRow = (std::numeric_limits<int>::lowest)();
+
+    // Cells created before the pipeline started still need to be closed.
+    for (auto& cellPair : m_cells)
+        m_openRows[cellPair.first.y()].push_back(&cellPair.second);
+}
+
+
+void Grid::finishPipeline()
+{
+    for (auto& rowPair : m_openRows)
+        for (GridCell *cell : rowPair.second)
+            submit(*cell);
+    m_openRows.clear();
+    flush();
+    m_pipelined = false;
+    await();
+    reap();
+}
+
+
+void Grid::advance(int row)
+{
+    // Until we've moved more than a band away from the first row seen we
+    // don't know which way the input is sorted.
+    if (m_sweep == 0)
     {
-        GridCell& cell = ci->second;
-        const GridIndex& idx = ci->first;
+        if (m_firstRow == (std::numeric_limits<int>::lowest)())
+            m_firstRow = row;
+        if (std::abs(row - m_firstRow) <= m_band)
+            return;
+        m_sweep = (row > m_firstRow ? 1 : -1);
+        m_frontRow = row;
+        closeRows(m_frontRow - m_sweep * (m_band + 1));
+        return;
+    }
 
-        cell.registration(minpts, debug);
+    if (m_sweep * (row - m_frontRow) > 0)
+    {
+        m_frontRow = row;
+        closeRows(m_frontRow - m_sweep * (m_band + 1));
     }
+    else if (m_sweep * (m_frontRow - row) > m_band)
+        throw pdal::pdal_error("Point in cell row " + std::to_string(row) +
+            " arrived after the row was registered. Input isn't sorted by "
+            "row within a band of " + std::to_string(m_band) + " rows.");
 }
 
 
-Eigen::Vector3d *Grid::getVector(int x, int y)
+// Submit all open rows at or beyond 'limit' (in the direction opposite
+// the sweep) for registration.
+void Grid::closeRows(int limit)
 {
-    auto ci = m_cells.find(GridIndex(x, y));
-    if (ci == m_cells.end())
-        return nullptr;
-    return &(ci->second.m_vec);
+    if (m_sweep > 0)
+    {
+        while (m_openRows.size() && m_openRows.begin()->first <= limit)
+        {
+            for (GridCell *cell : m_openRows.begin()->second)
+                submit(*cell);
+            m_openRows.erase(m_openRows.begin());
+        }
+    }
+    else
+    {
+        while (m_openRows.size() && m_openRows.rbegin()->first >= limit)
+        {
+            auto last = std::prev(m_openRows.end());
+            for (GridCell *cell : last->second)
+                submit(*cell);
+            m_openRows.erase(last);
+        }
+    }
+    flush();
+    reap();
 }
 
-//
-// GridCell
-//
 
-void GridCell::registration(int minpts, bool debug)
+void Grid::submit(GridCell& cell)
 {
-    using namespace pdal::Dimension;
+    cell.m_submitted = true;
 
-    if (!m_before || !m_after || m_before->size() < minpts || m_after->size() < minpts)
+    if (!cell.registrable(m_opts))
     {
-//         std::cerr << "Aborting for " << m_x << "/" << m_y << ".\n";
+        finish(cell);
         return;
     }
-//     std::cerr << "Computing for " << m_x << "/" << m_y << ".\n";
+    if (m_opts.adaptiveLevels > 0 &&
+        (cell.count(Order::Before) > m_opts.maxPoints ||
+            cell.count(Order::After) > m_opts.maxPoints) &&
+        split(cell))
+        return;
 
-    // Convert points to Eigen Matrices.
-    Eigen::MatrixX3d bm(m_before->size(), 3);
-    for (size_t i = 0; i < m_before->size(); ++i)
+    // Small cells are collected and registered in batches. Others are
+    // registered on their own.
+    if (m_opts.batchSize > 1 &&
+        cell.count(Order::Before) * cell.count(Order::After) <=
+            m_opts.directLimit)
     {
-        bm(i, 0) = m_before->getFieldAs<double>(Id::X, i);
-        bm(i, 1) = m_before->getFieldAs<double>(Id::Y, i);
-        bm(i, 2) = m_before->getFieldAs<double>(Id::Z, i);
+        m_batch.push_back(&cell);
+        if (m_batch.size() >= m_opts.batchSize)
+            flush();
+        return;
     }
-    Eigen::MatrixX3d am(m_after->size(), 3);
-    for (size_t i = 0; i < m_after->size(); ++i)
+
+    RegistrationOptions opts = m_opts;
+    addTask([this, &cell, opts]()
+    {
+        Admission admission(*this, workingBytes(cell));
+        admission.loaded(load(cell));
+        cell.registration(opts);
+        bootstrap({ &cell }, opts);
+        finish(cell);
+    });
+}
+
+
+// Register a cell with more points than the budget as the leaves of a
+// quadtree over it (see quarter()), each on its own, so that no task is
+// much longer than the others. The cell takes their combined result once
+// the last is done. The leaves are built here, on the ingest thread, and
+// take the cell's points, which they hold until then. Returns false if
+// none of them can be registered, in which case the points are returned to
+// the cell, which should be registered whole.
+bool Grid::split(GridCell& cell)
+{
+    std::shared_ptr<SplitCell> state(new SplitCell);
+    state->cell = &cell;
     {
-        am(i, 0) = m_after->getFieldAs<double>(Id::X, i);
-        am(i, 1) = m_after->getFieldAs<double>(Id::Y, i);
-        am(i, 2) = m_after->getFieldAs<double>(Id::Z, i);
+        // Quartering copies the points a level at a time, which takes no
+        // more than the engine's copies would.
+        Admission admission(*this, workingBytes(cell));
+        admission.loaded(load(cell));
+
+        // The center is all that's needed of the cell's points.
+        double zMean = 0;
+        for (const Eigen::Vector3d& p : cell.m_before)
+            zMean += p(2);
+        zMean /= cell.m_before.size();
+        cell.m_center = Eigen::Vector3d((cell.m_x + .5) * cell.m_len,
+            (cell.m_y + .5) * cell.m_len, zMean);
+
+        size_t bytes = cell.bytes();
+        GridCell root(cell.m_x, cell.m_y, cell.m_len);
+        root.m_before.swap(cell.m_before);
+        root.m_after.swap(cell.m_after);
+        cell.m_moved[0] = root.m_before.size();
+        cell.m_moved[1] = root.m_after.size();
+        std::vector<GridCell> leaves;
+        quarter(root, m_opts.adaptiveLevels, m_opts, leaves);
+
+        for (GridCell& leaf : leaves)
+            if (leaf.registrable(m_opts))
+                state->parts.push_back(std::move(leaf));
+        if (state->parts.empty())
+        {
+            cell.m_before.reserve(cell.m_moved[0]);
+            cell.m_after.reserve(cell.m_moved[1]);
+            for (const GridCell& leaf : leaves)
+            {
+                cell.m_before.insert(cell.m_before.end(),
+                    leaf.m_before.begin(), leaf.m_before.end());
+                cell.m_after.insert(cell.m_after.end(),
+                    leaf.m_after.begin(), leaf.m_after.end());
+            }
+            cell.m_moved[0] = 0;
+            cell.m_moved[1] = 0;
+            m_held += cell.bytes();
+            m_held -= bytes;
+            return false;
+        }
+        // Leaves that can't be registered are dropped.
+        for (const GridCell& part : state->parts)
+            m_held += part.bytes();
+        m_held -= bytes;
     }
+    state->remaining = state->parts.size();
 
-    auto result = cpd::rigid(bm, am);
-    Eigen::Matrix4d xform = result.matrix();
-    Eigen::Matrix4d inv = xform.inverse();
+    RegistrationOptions opts = m_opts;
+    for (GridCell& part : state->parts)
+    {
+        GridCell *p = &part;
+        addTask([this, state, p, opts]()
+        {
+            {
+                Admission admission(*this, workingBytes(*p));
+                p->registration(opts);
+                bootstrap({ p }, opts);
+            }
+            if (--state->remaining)
+                return;
 
-    // Find the average Z value to use for our velocity raster.
-    auto lastcol = bm.col(bm.cols() - 1);
-    double zMean = lastcol.mean();
-    Eigen::Vector4d vec((m_x + .5) * m_len, (m_y + .5) * m_len, zMean, 1);
+            // Each point is moved by the transform of its own part.
+            GridCell& cell = *state->cell;
+            cell.combine(state->parts);
+            if (m_pointWriter)
+                for (const GridCell& part : state->parts)
+                {
+                    if (!part.m_registered)
+                        continue;
+                    std::vector<PointRecord> recs = part.pointRecords();
+                    for (PointRecord& rec : recs)
+                    {
+                        rec.cellX = cell.m_x;
+                        rec.cellY = cell.m_y;
+                    }
+                    m_pointWriter->write(std::move(recs));
+                }
+            for (GridCell& part : state->parts)
+            {
+                size_t bytes = part.bytes();
+                part.release();
+                m_held -= bytes;
+            }
+            finish(cell);
+        });
+    }
+    return true;
+}
 
-    // CPD creates a transformation from the _after_ (moving) set to the
-    // _before_ (fixed) set. We want it the other way around, so we multiply
-    // the inverse of the transform on the left by the point we want transformed.
-    // We then subtract the original source vector to get actual movement.
-    // The result is a 4x1 vector, so we trim it to 3x1.
-    m_vec = ((inv * vec) - vec).head(3);
-    if (debug)
+
+// Register cells with too few points in blocks of neighbours: aligned
+// blocks of 2 x 2 cells, then 4 x 4 and so on to opts.adaptiveLevels, with
+// each cell going into the smallest block whose cells have enough points
+// between them (and no more than the budget). Cells without both before
+// and after points have nothing of their own to measure and are left
+// alone, as are those that no block can take.
+void Grid::mergeSparse()
+{
+    std::vector<GridCell *> sparse;
+    for (auto& cellPair : m_cells)
+    {
+        GridCell& cell = cellPair.second;
+        if (!cell.registrable(m_opts) && cell.count(Order::Before) &&
+                cell.count(Order::After))
+            sparse.push_back(&cell);
+    }
+
+    for (int level = 1; level <= m_opts.adaptiveLevels && sparse.size();
+            ++level)
     {
-        std::cerr << "Inverse transform =\n" << inv << "\n\n";
-        for (size_t i = 0; i < bm.rows(); ++i)
+        // Shifts round toward negative infinity, so blocks stay aligned
+        // on both sides of the origin.
+        std::map<GridIndex, std::vector<GridCell *>> blocks;
+        for (GridCell *cell : sparse)
+            blocks[GridIndex(cell->m_x >> level, cell->m_y >> level)].
+                push_back(cell);
+        sparse.clear();
+
+        for (auto& blockPair : blocks)
         {
-            Eigen::Vector4d vec(bm(i, 0), bm(i, 1), bm(i, 2), 1);
-            Eigen::Vector3d out = ((inv * vec) - vec).head(3);
-            std::cerr << "Vec = (" << vec(0) << ", " << vec(1) << ", " << vec(2) << ") -> (" <<
-                out(0) << ", " << out(1) << ", " << out(2) << ")\n";
+            std::vector<GridCell *>& cells = blockPair.second;
+            size_t before = 0;
+            size_t after = 0;
+            for (GridCell *cell : cells)
+            {
+                before += cell->count(Order::Before);
+                after += cell->count(Order::After);
+            }
+            if (cells.size() > 1 && before >= (size_t)m_opts.minpts &&
+                    after >= (size_t)m_opts.minpts &&
+                    before <= m_opts.maxPoints && after <= m_opts.maxPoints)
+                submitBlock(cells, blockPair.first, level);
+            else
+                sparse.insert(sparse.end(), cells.begin(), cells.end());
         }
     }
-    else
+}
+
+
+// Register the points of 'cells', which lie in cell 'block' of a grid of
+// cells 2^level times as long, as one.
+void Grid::submitBlock(const std::vector<GridCell *>& cells,
+    const GridIndex& block, int level)
+{
+    for (GridCell *cell : cells)
+        cell->m_submitted = true;
+
+    RegistrationOptions opts = m_opts;
+    double len = m_len * (double)(1 << level);
+    int x = block.x();
+    int y = block.y();
+    addTask([this, cells, x, y, len, opts]()
     {
-//         std::cerr << "Vec = (" << vec(0) << ", " << vec(1) << ", " << vec(2) << ") -> (" <<
-//                 m_vec(0) << ", " << m_vec(1) << ", " << m_vec(2) << ")\n";
+        size_t working = 0;
+        for (GridCell *cell : cells)
+            working += workingBytes(*cell);
+        Admission admission(*this, working);
+        GridCell merged(x, y, len);
+        for (GridCell *cell : cells)
+        {
+            admission.loaded(load(*cell));
+            merged.m_before.insert(merged.m_before.end(),
+                cell->m_before.begin(), cell->m_before.end());
+            merged.m_after.insert(merged.m_after.end(),
+                cell->m_after.begin(), cell->m_after.end());
+        }
+        merged.registration(opts);
+        bootstrap({ &merged }, opts);
+        for (GridCell *cell : cells)
+        {
+            cell->adopt(merged, opts.debug);
+            finish(*cell);
+        }
+    });
+}
+
+
+void Grid::flush()
+{
+    if (m_batch.empty())
+        return;
+
+    std::vector<GridCell *> cells;
+    cells.swap(m_batch);
+    RegistrationOptions opts = m_opts;
+    addTask([this, cells, opts]()
+    {
+        size_t working = 0;
+        for (GridCell *cell : cells)
+            working += workingBytes(*cell);
+        Admission admission(*this, working);
+        // Engines other than CPD use the cells' before indexes.
+        bool indexed = (opts.engine != RegistrationOptions::Cpd);
+        std::unique_ptr<Engine> engine(Engine::create(opts));
+        for (GridCell *cell : cells)
+        {
+            admission.loaded(load(*cell));
+            engine->add(cell->m_before, cell->m_after,
+                indexed ? &cell->index(Order::Before) : nullptr);
+        }
+        engine->run();
+        for (size_t i = 0; i < cells.size(); ++i)
+            cells[i]->setResult(engine->result(i), opts.debug);
+        bootstrap(cells, opts);
+        for (GridCell *cell : cells)
+            finish(*cell);
+    });
+}
+
+
+// Called on a worker once a cell's result is final, or when submitted if
+// it won't be registered. The cell's points are freed and its result moved
+// to m_results. The cell mustn't be touched after, as the ingest thread
+// may erase it.
+void Grid::finish(GridCell& cell)
+{
+    if (m_field)
+        complete(cell);
+    if (m_cellWriter && cell.m_registered)
+        m_cellWriter->write(cell.record());
+    // Split cells' points were written with their parts.
+    if (m_pointWriter && cell.m_registered &&
+            !(cell.m_flags & CellFlag::Split))
+        m_pointWriter->write(cell.pointRecords());
+
+    size_t bytes = cell.bytes();
+    cell.release();
+    m_held -= bytes;
+
+    std::lock_guard<std::mutex> lock(m_resultMutex);
+    m_results.push_back(cell.result());
+    m_finished.emplace_back(cell.m_x, cell.m_y);
+}
+
+
+// Erase finished cells from m_cells. Called on the ingest thread, which
+// is the only one that looks cells up.
+void Grid::reap()
+{
+    std::vector<GridIndex> finished;
+    {
+        std::lock_guard<std::mutex> lock(m_resultMutex);
+        finished.swap(m_finished);
+    }
+    for (const GridIndex& index : finished)
+    {
+        auto ci = m_cells.find(index);
+        if (&ci->second == m_lastCell)
+            m_lastCell = nullptr;
+        m_cells.erase(ci);
     }
 }
 
-//
-// GridIter
-//
 
-GridIter::GridIter(Grid& grid, pdal::Dimension::Id dim) :
-    m_grid(grid), m_pos(0), m_dimOffset(-1)
+void Grid::setTileOutput(DisplacementGrid *field, size_t tileSize,
+    std::function<void(const DisplacementGrid::Tile&)> done)
 {
-    using namespace pdal::Dimension;
+    m_field = field;
+    m_tileSize = tileSize;
+    m_tilesAcross = (field->xSize() + tileSize - 1) / tileSize;
+    m_tiles = field->tiles(tileSize);
+    m_tileDone = done;
 
-    if (dim != Id::X && dim != Id::Y && dim != Id::Z &&
-            dim != Id::Unknown)
-        std::cerr << "Dimension must be X, Y, Z or Unknown.\n";
-    m_dimOffset = static_cast<int>(dim) - 1;
+    std::vector<size_t> counts(m_tiles.size());
+    for (auto& cellPair : m_cells)
+    {
+        const GridCell& cell = cellPair.second;
+        size_t col = cell.m_x - m_xOrigin;
+        size_t row = cell.m_y - m_yOrigin;
+        counts[(row / tileSize) * m_tilesAcross + col / tileSize]++;
+    }
+    m_tileCells.reset(new std::atomic<size_t>[m_tiles.size()]);
+    for (size_t t = 0; t < m_tiles.size(); ++t)
+        m_tileCells[t] = counts[t];
+    for (size_t t = 0; t < m_tiles.size(); ++t)
+        if (counts[t] == 0)
+            m_tileDone(m_tiles[t]);
 }
 
-int32_t GridIter::x() const
+
+// Set a finished cell's result in the tile output and hand on its tile if
+// it was the tile's last cell.
+void Grid::complete(const GridCell& cell)
 {
-    return (m_pos % m_grid.xSize()) + m_grid.xOrigin();
+    size_t col = cell.m_x - m_xOrigin;
+    size_t row = cell.m_y - m_yOrigin;
+    Eigen::Vector3d vec = cell.m_registered ? cell.m_vec :
+        Eigen::Vector3d::Constant(DisplacementGrid::NoData);
+    m_field->set(col, row, vec, cell.m_flags);
+    if (m_field->hasStd())
+        m_field->setStd(col, row, cell.m_std);
+
+    size_t t = (row / m_tileSize) * m_tilesAcross + col / m_tileSize;
+    if (--m_tileCells[t] == 0)
+        m_tileDone(m_tiles[t]);
 }
 
-int32_t GridIter::y() const
+
+void Grid::addTask(std::function<void()> task)
 {
-    return (m_pos / m_grid.xSize()) + m_grid.yOrigin();
+    // The queue is bounded so that, when pipelined, ingestion stalls rather
+    // than piling up closed cells faster than they can be registered.
+    if (!m_pool)
+    {
+        size_t threads = (std::max)(m_threads, 1);
+        m_ownPool.reset(new pdal::ThreadPool(threads, threads * 4, false));
+        m_pool = m_ownPool.get();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_taskMutex);
+        m_outstanding++;
+    }
+    m_pool->add([this, task]()
+    {
+        std::string error;
+        try
+        {
+            task();
+        }
+        catch (const std::exception& err)
+        {
+            error = err.what();
+        }
+
+        std::lock_guard<std::mutex> lock(m_taskMutex);
+        if (error.size())
+            m_errors.push_back(error);
+        m_outstanding--;
+        m_taskDone.notify_all();
+    });
 }
 
-GridIter& GridIter::operator++()
+
+// Wait for this grid's tasks to finish.
+void Grid::wait()
 {
-    m_pos++;
-    return *this;
+    std::unique_lock<std::mutex> lock(m_taskMutex);
+    m_taskDone.wait(lock, [this](){ return m_outstanding == 0; });
 }
 
 
-GridIter GridIter::operator++(int)
+// Wait for this grid's tasks to finish and throw the first error any of
+// them raised.
+void Grid::await()
 {
-    GridIter it(*this);
-    m_pos++;
-    return it;
+    wait();
+
+    std::lock_guard<std::mutex> lock(m_taskMutex);
+    if (m_errors.size())
+    {
+        std::string error = m_errors.front();
+        m_errors.clear();
+        throw pdal::pdal_error(error);
+    }
 }
 
-GridIter& GridIter::operator--()
+
+Grid::~Grid()
 {
-    m_pos--;
-    return *this;
+    // Tasks still queued (e.g. after an error) refer to our cells.
+    wait();
 }
 
-GridIter GridIter::operator--(int)
+
+size_t Grid::countFlags(unsigned flag) const
 {
-    GridIter it(*this);
-    m_pos--;
-    return it;
+    std::lock_guard<std::mutex> lock(m_resultMutex);
+    size_t count = 0;
+    for (const CellResult& res : m_results)
+        if (res.flags & flag)
+            count++;
+    return count;
 }
 
-GridIter GridIter::operator+(const difference_type& n) const
+
+DisplacementGrid Grid::displacements(bool uncertainty) const
 {
-    GridIter it(*this);
-    it.m_pos = m_pos + n;
-    return it;
+    if (m_cellCount == 0)
+        return DisplacementGrid();
+
+    // Cells that haven't finished are left NoData.
+    DisplacementGrid out(m_len, m_xOrigin, m_yOrigin, m_xSize, m_ySize);
+    if (uncertainty)
+        out.addStdBands();
+    std::lock_guard<std::mutex> lock(m_resultMutex);
+    for (const CellResult& res : m_results)
+    {
+        // Cells that weren't registered keep their flags, which say why.
+        Eigen::Vector3d vec = res.registered ?
+            Eigen::Vector3d(res.vec[0], res.vec[1], res.vec[2]) :
+            Eigen::Vector3d::Constant(DisplacementGrid::NoData);
+        out.set(res.x - m_xOrigin, res.y - m_yOrigin, vec, res.flags);
+        if (uncertainty)
+            out.setStd(res.x - m_xOrigin, res.y - m_yOrigin,
+                Eigen::Vector3d(res.std[0], res.std[1], res.std[2]));
+    }
+    return out;
 }
 
 
-GridIter GridIter::operator-(const difference_type& n) const
+size_t Grid::regularize(DisplacementGrid& field,
+    const RegularizeOptions& opts)
 {
-    GridIter it(*this);
-    it.m_pos = m_pos - n;
-    return it;
+    // Every task reads the original field, so the result doesn't depend on
+    // the order in which rows are processed.
+    const DisplacementGrid in(field);
+    std::atomic<size_t> replaced(0);
+
+    parallelFor(field.ySize(), [&](size_t begin, size_t end)
+    {
+        replaced += regularizeRows(in, field, begin, end, opts);
+    });
+    return replaced;
 }
 
-const double& GridIter::operator*() const
+
+void Grid::buildIndex(AP::Order order)
 {
-    static double empty(-9999);
+    std::vector<const GridCell *> cells;
+    for (auto& cellPair : m_cells)
+        cells.push_back(&cellPair.second);
 
-    Eigen::Vector3d *vec = m_grid.getVector(x(), y());
-    if (!vec)
-        return empty;
-    return (*vec)(m_dimOffset);
+    parallelFor(cells.size(), [&cells, order](size_t begin, size_t end)
+    {
+        for (size_t i = begin; i < end; ++i)
+            cells[i]->index(order);
+    });
 }
 
-double& GridIter::operator*()
+
+void Grid::parallelFor(size_t count,
+    const std::function<void(size_t, size_t)>& fn)
 {
-    const double& d = const_cast<const GridIter *>(this)->operator *();
-    return const_cast<double&>(d);
+    // A few ranges per thread, so that uneven ranges balance out.
+    size_t step = (std::max)(count / (4 * (std::max)(m_threads, 1)),
+        (size_t)1);
+    for (size_t begin = 0; begin < count; begin += step)
+    {
+        size_t end = (std::min)(begin + step, count);
+        addTask([&fn, begin, end](){ fn(begin, end); });
+    }
+    await();
 }
 
-const double *GridIter::operator->() const
+//
+// GridCell
+//
+
+size_t GridCell::count(AP::Order order) const
 {
-    static double empty(-9999);
+    int i = (order == Order::Before ? 0 : 1);
+    size_t n = (i == 0 ? m_before : m_after).size() + m_moved[i];
+    for (const SpillFile::Extent& e : m_spilled[i])
+        n += e.count;
+    return n;
+}
+
 
-    Eigen::Vector3d *vec = m_grid.getVector(x(), y());
-    if (!vec)
-        return &empty;
-    return &(*vec)(m_dimOffset);
+bool GridCell::registrable(const RegistrationOptions& opts) const
+{
+    return count(Order::Before) >= (size_t)opts.minpts &&
+        count(Order::After) >= (size_t)opts.minpts;
+}
+
+
+void GridCell::registration(const RegistrationOptions& opts)
+{
+    if (!registrable(opts))
+    {
+//         std::cerr << "Aborting for " << m_x << "/" << m_y << ".\n";
+        return;
+    }
+//     std::cerr << "Computing for " << m_x << "/" << m_y << ".\n";
+
+    bool indexed = (opts.engine != RegistrationOptions::Cpd);
+    std::unique_ptr<Engine> engine(Engine::create(opts));
+    engine->add(m_before, m_after, indexed ? &index(Order::Before) : nullptr);
+    engine->run();
+    setResult(engine->result(0), opts.debug);
+}
+
+
+void GridCell::setResult(const Engine::Result& result, bool debug)
+{
+    m_flags = result.flags;
+    m_iterations = result.iterations;
+    m_sigma2 = result.sigma2;
+    if (result.valid)
+    {
+        setTransform(result.transform, debug);
+        m_registered = true;
+    }
+}
+
+
+// Set the cell's vector from the transform that maps the after points onto
+// the before points.
+void GridCell::setTransform(const Eigen::Matrix4d& xform, bool debug)
+{
+    Eigen::Matrix4d inv = xform.inverse();
+
+    // Find the average Z value to use for our velocity raster.
+    double zMean = 0;
+    for (const Eigen::Vector3d& p : m_before)
+        zMean += p(2);
+    zMean /= m_before.size();
+    Eigen::Vector4d vec((m_x + .5) * m_len, (m_y + .5) * m_len, zMean, 1);
+    m_center = vec.head(3);
+    m_transform = inv;
+
+    // CPD creates a transformation from the _after_ (moving) set to the
+    // _before_ (fixed) set. We want it the other way around, so we multiply
+    // the inverse of the transform on the left by the point we want transformed.
+    // We then subtract the original source vector to get actual movement.
+    // The result is a 4x1 vector, so we trim it to 3x1.
+    m_vec = ((inv * vec) - vec).head(3);
+    if (debug)
+    {
+        // Cells are registered concurrently, so build the dump and write
+        // it in one go to keep it from being interleaved with other cells.
+        // Per-point results are written by a PointWriter.
+        std::ostringstream out;
+        out << "Cell " << m_x << "/" << m_y << " inverse transform =\n" <<
+            inv << "\n\n";
+        std::cerr << out.str();
+    }
+    else
+    {
+//         std::cerr << "Vec = (" << vec(0) << ", " << vec(1) << ", " << vec(2) << ") -> (" <<
+//                 m_vec(0) << ", " << m_vec(1) << ", " << m_vec(2) << ")\n";
+    }
+}
+
+
+void GridCell::adopt(const GridCell& block, bool debug)
+{
+    m_flags = block.m_flags | CellFlag::Merged;
+    m_iterations = block.m_iterations;
+    m_sigma2 = block.m_sigma2;
+    m_std = block.m_std;
+    if (block.m_registered)
+    {
+        // setTransform() takes the transform from the after points to the
+        // before points.
+        setTransform(block.m_transform.inverse(), debug);
+        m_registered = true;
+    }
+}
+
+
+// The transform is that of the part with the most before points, which
+// is all that CellRecord can hold.
+void GridCell::combine(const std::vector<GridCell>& parts)
+{
+    m_flags = CellFlag::Split;
+    m_iterations = 0;
+    double total = 0;
+    double largest = 0;
+    Eigen::Vector3d vec = Eigen::Vector3d::Zero();
+    Eigen::Vector3d var = Eigen::Vector3d::Zero();
+    bool hasStd = true;
+    double sigma2 = 0;
+    for (const GridCell& part : parts)
+    {
+        m_flags |= part.m_flags;
+        m_iterations = (std::max)(m_iterations, part.m_iterations);
+        if (!part.m_registered)
+            continue;
+
+        double weight = (double)part.m_before.size();
+        total += weight;
+        vec += weight * part.m_vec;
+        sigma2 += weight * part.m_sigma2;
+        if (part.m_std(0) == DisplacementGrid::NoData)
+            hasStd = false;
+        else
+            var += weight * part.m_std.cwiseAbs2();
+        if (weight > largest)
+        {
+            largest = weight;
+            m_transform = part.m_transform;
+        }
+    }
+    if (total == 0)
+        return;
+
+    m_vec = vec / total;
+    m_sigma2 = sigma2 / total;
+    if (hasStd)
+        m_std = (var / total).cwiseSqrt();
+    m_registered = true;
+}
+
+
+CellRecord GridCell::record() const
+{
+    CellRecord rec;
+    rec.x = m_x;
+    rec.y = m_y;
+    rec.flags = m_flags;
+    rec.iterations = (uint32_t)m_iterations;
+    for (int d = 0; d < 3; ++d)
+    {
+        rec.center[d] = m_center(d);
+        rec.vec[d] = m_vec(d);
+    }
+    for (int r = 0; r < 3; ++r)
+        for (int c = 0; c < 4; ++c)
+            rec.transform[r * 4 + c] = m_transform(r, c);
+    rec.sigma2 = m_sigma2;
+    for (int d = 0; d < 3; ++d)
+        rec.std[d] = m_std(d);
+    rec.beforeCount = count(Order::Before);
+    rec.afterCount = count(Order::After);
+    return rec;
 }
 
-double *GridIter::operator->()
+
+CellResult GridCell::result() const
+{
+    CellResult res;
+    res.x = m_x;
+    res.y = m_y;
+    res.flags = m_flags;
+    res.registered = m_registered;
+    for (int d = 0; d < 3; ++d)
+    {
+        res.vec[d] = m_vec(d);
+        res.std[d] = m_std(d);
+    }
+    return res;
+}
+
+
+const KdTree& GridCell::index(AP::Order order) const
+{
+    int i = (order == Order::Before ? 0 : 1);
+    const PointList& points = (i == 0 ? m_before : m_after);
+    CellIndex& idx = *m_index;
+    std::call_once(idx.built[i], [&idx, &points, i]()
+        { idx.tree[i].build(points); });
+    return idx.tree[i];
+}
+
+
+// Called once registered. Builds the index of the after points.
+std::vector<PointRecord> GridCell::pointRecords() const
+{
+    const KdTree& after = index(Order::After);
+
+    std::vector<PointRecord> recs(m_before.size());
+    for (size_t i = 0; i < m_before.size(); ++i)
+    {
+        const Eigen::Vector3d& p = m_before[i];
+        Eigen::Vector3d moved = (m_transform * p.homogeneous()).head(3);
+        double dist2;
+        if (after.nearest(moved, dist2) == after.size())
+            dist2 = std::numeric_limits<double>::quiet_NaN();
+
+        PointRecord& rec = recs[i];
+        for (int d = 0; d < 3; ++d)
+        {
+            rec.position[d] = p(d);
+            rec.displacement[d] = (float)(moved(d) - p(d));
+        }
+        rec.residual = (float)std::sqrt(dist2);
+        rec.cellX = m_x;
+        rec.cellY = m_y;
+    }
+    return recs;
+}
+
+
+void GridCell::release()
 {
-    const double& d = const_cast<const GridIter *>(this)->operator *();
-    double& dd = const_cast<double &>(d);
-    return &dd;
+    PointList().swap(m_before);
+    PointList().swap(m_after);
+    m_index = std::make_shared<CellIndex>();
 }
 
 } // namespace
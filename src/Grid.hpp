@@ -1,15 +1,31 @@
 #pragma once
 
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <mutex>
 #include <unordered_map>
 
 #include <Eigen/Dense>
 #include <pdal/PointView.hpp>
+#include <pdal/util/ThreadPool.hpp>
 
+#include "CellWriter.hpp"
+#include "DisplacementGrid.hpp"
+#include "Engine.hpp"
+#include "KdTree.hpp"
+#include "PointWriter.hpp"
+#include "SpillFile.hpp"
 #include "Types.hpp"
 
 namespace AtlasProcessor
 {
 
+// Cell index, keyed by its Morton (Z-order) code: the bits of X and Y,
+// offset so that negative indices sort first, interleaved with X in the
+// even bits. Ordering by key visits cells quadrant by quadrant, so cells
+// that are close in the grid are close in the order, and every aligned
+// 2^n x 2^n tile of cells is a contiguous range of keys.
 struct GridIndex
 {
 public:
@@ -17,10 +33,10 @@ public:
     { assert(x == this->x()); assert(y == this->y()); }
 
     int32_t x() const
-    { return (uint32_t)m_key; }
+    { return (int32_t)(compact(m_key) ^ Bias); }
 
     int32_t y() const
-    { return (uint32_t)(m_key >> 32); }
+    { return (int32_t)(compact(m_key >> 1) ^ Bias); }
 
     uint64_t key() const
     { return m_key; }
@@ -28,12 +44,39 @@ public:
     bool operator==(const GridIndex& other) const
     { return m_key == other.m_key; }
 
+    bool operator<(const GridIndex& other) const
+    { return m_key < other.m_key; }
+
 private:
-    uint64_t key(int32_t x, int32_t y)
+    static const uint32_t Bias = 0x80000000;
+
+    static uint64_t key(int32_t x, int32_t y)
+    {
+        return spread((uint32_t)x ^ Bias) | (spread((uint32_t)y ^ Bias) << 1);
+    }
+
+    // Move bit i of 'v' to bit 2i.
+    static uint64_t spread(uint32_t v)
     {
-        uint32_t ux = (uint32_t)x;
-        uint32_t uy = (uint32_t)y;
-        return (ux | ((uint64_t)uy << 32));
+        uint64_t k = v;
+        k = (k | (k << 16)) & 0x0000FFFF0000FFFFull;
+        k = (k | (k << 8)) & 0x00FF00FF00FF00FFull;
+        k = (k | (k << 4)) & 0x0F0F0F0F0F0F0F0Full;
+        k = (k | (k << 2)) & 0x3333333333333333ull;
+        k = (k | (k << 1)) & 0x5555555555555555ull;
+        return k;
+    }
+
+    // Inverse of spread(), ignoring the odd bits.
+    static uint32_t compact(uint64_t k)
+    {
+        k &= 0x5555555555555555ull;
+        k = (k | (k >> 1)) & 0x3333333333333333ull;
+        k = (k | (k >> 2)) & 0x0F0F0F0F0F0F0F0Full;
+        k = (k | (k >> 4)) & 0x00FF00FF00FF00FFull;
+        k = (k | (k >> 8)) & 0x0000FFFF0000FFFFull;
+        k = (k | (k >> 16)) & 0x00000000FFFFFFFFull;
+        return (uint32_t)k;
     }
 
     uint64_t m_key;
@@ -60,47 +103,207 @@ namespace AtlasProcessor
 
 class Grid;
 
+// Spatial indexes of a cell's before and after points, each built once, on
+// first use. Shared by the copies of a cell (std::once_flag can't be
+// copied), of which the grid keeps only one.
+struct CellIndex
+{
+    std::once_flag built[2];
+    KdTree tree[2];
+};
+
+// What's kept of a cell once it has been registered and its points freed.
+// Held in a dense array, apart from the cells still being filled.
+struct CellResult
+{
+    int32_t x;
+    int32_t y;
+    unsigned flags;
+    bool registered;
+    double vec[3];
+    double std[3];
+};
+
+// Points are held per cell in a PointList (rather than in views on a shared
+// table) so that a cell's memory can be released as soon as it has been
+// registered and so that cells can be registered while other cells are
+// still being filled.
 struct GridCell
 {
     int m_x;
     int m_y;
 
-    int m_len;
-    pdal::PointViewPtr m_before;
-    pdal::PointViewPtr m_after;
+    // Less than the grid's cell length for the parts of a split cell, more
+    // for a block of merged cells.
+    double m_len;
+    PointList m_before;
+    PointList m_after;
     Eigen::Vector3d m_vec;
+    // Cell center at the mean height of the before points.
+    Eigen::Vector3d m_center;
+    // Maps the before points onto the after points.
+    Eigen::Matrix4d m_transform;
+    bool m_registered;
+    unsigned m_flags;
+    size_t m_iterations;
+    double m_sigma2;
+    // Standard deviation of each component of m_vec (see bootstrap()), or
+    // NoData.
+    Eigen::Vector3d m_std;
+    // Before and after points written to the grid's spill file, which come
+    // ahead of those in m_before and m_after.
+    std::vector<SpillFile::Extent> m_spilled[2];
+    // Grid's insertion clock when the cell last received points.
+    uint64_t m_touched;
+    // Handed to registration, after which only workers touch the cell.
+    bool m_submitted;
+    // Before and after points moved to the parts of a split cell (see
+    // Grid::split()), which count() includes.
+    size_t m_moved[2];
 
-    GridCell(pdal::PointTableRef table, int x, int y, int len, pdal::PointViewPtr inView) :
-        m_x(x), m_y(y), m_len(len)
-    {
-        using namespace pdal;
+    GridCell(int x, int y, double len) : m_x(x), m_y(y), m_len(len),
+        m_registered(false), m_flags(0), m_iterations(0), m_sigma2(0),
+        m_std(Eigen::Vector3d::Constant(DisplacementGrid::NoData)),
+        m_touched(0), m_submitted(false), m_moved(),
+        m_index(std::make_shared<CellIndex>())
+    {}
+    // Number of before or after points, including any spilled.
+    size_t count(AP::Order order) const;
+    // Bytes held by the cell's point lists.
+    size_t bytes() const
+        { return (m_before.capacity() + m_after.capacity()) *
+            sizeof(Eigen::Vector3d); }
+    // Index of the before or after points, built on first use. May be
+    // called from any thread once the cell's points are complete. Freed by
+    // release().
+    const KdTree& index(AP::Order order) const;
+    bool registrable(const RegistrationOptions& opts) const;
+    void registration(const RegistrationOptions& opts);
+    void setResult(const Engine::Result& result, bool debug);
+    void setTransform(const Eigen::Matrix4d& xform, bool debug);
+    // Take the result of 'block', a block of merged cells that includes
+    // this one, evaluated at this cell.
+    void adopt(const GridCell& block, bool debug);
+    // Take the mean of the results of 'parts', the quadrants into which
+    // this cell was split, weighted by their before points. The cell's
+    // center is set when it's split.
+    void combine(const std::vector<GridCell>& parts);
+    CellRecord record() const;
+    CellResult result() const;
+    // Per-point results, for each before point.
+    std::vector<PointRecord> pointRecords() const;
+    void release();
 
-        m_before = std::make_shared<PointView>(table);
-        m_after = std::make_shared<PointView>(table);
-    }
-    void registration(int minpts, bool debug);
+private:
+    std::shared_ptr<CellIndex> m_index;
 };
 
 class Grid
 {
 public:
-    Grid(int len) : m_len(len),
+    // Registration runs on 'pool' if provided, which may be shared with
+    // other grids. Otherwise the grid creates a pool of 'threads' threads.
+    Grid(int len, int threads, pdal::ThreadPool *pool = nullptr) :
+        m_len(len), m_threads(threads),
         m_xSize(std::numeric_limits<int>::lowest()),
         m_ySize(std::numeric_limits<int>::lowest()),
         m_xOrigin(std::numeric_limits<int>::lowest()),
-        m_yOrigin(std::numeric_limits<int>::lowest())
-    {
-        using namespace pdal;
+        m_yOrigin(std::numeric_limits<int>::lowest()),
+        m_lastCell(nullptr), m_points(0), m_pool(pool), m_cellWriter(nullptr),
+        m_pointWriter(nullptr), m_field(nullptr), m_cellCount(0),
+        m_xMin((std::numeric_limits<int>::max)()),
+        m_xMax((std::numeric_limits<int>::lowest)()),
+        m_yMin((std::numeric_limits<int>::max)()),
+        m_yMax((std::numeric_limits<int>::lowest)()), m_outstanding(0),
+        m_held(0), m_memoryLimit(0), m_clock(0), m_working(0),
+        m_pipelined(false)
+    {}
+    ~Grid();
 
-        m_table.layout()->registerDims( {Dimension::Id::X, Dimension::Id::Y, Dimension::Id::Z} );
-        m_table.finalize();
-    }
-
-    void insert(pdal::PointViewPtr in, AP::Order order);
-    Eigen::Vector3d *getVector(int x, int y);
-    void registration(int minpts, bool debug);
+    void insert(pdal::PointViewPtr in, AP::Order order,
+        const PointFilter& filter = PointFilter());
+    void insert(double x, double y, double z, AP::Order order);
+    // Insert 'count' points stored as consecutive X, Y, Z values.
+    void insert(const double *xyz, size_t count, AP::Order order);
+    // Insert 'count' records, 'stride' bytes apart, that hold X, Y and Z as
+    // doubles at byte offsets 'offsets'. Points outside of rows
+    // [rowBegin, rowEnd) of cells are skipped.
+    void insert(const char *data, size_t count, size_t stride,
+        const size_t offsets[3], AP::Order order,
+        int rowBegin = (std::numeric_limits<int>::lowest)(),
+        int rowEnd = (std::numeric_limits<int>::max)());
+    // Register every cell. Each cell's points are freed as soon as its
+    // result is final (after being written to any point writer), leaving
+    // only its CellResult. With opts.adaptiveLevels, dense cells are
+    // registered as quadrants and sparse ones as blocks (see split() and
+    // mergeSparse()), and the results put back on the grid's cells.
+    void registration(const RegistrationOptions& opts);
     void calcLimits();
+    size_t countFlags(unsigned flag) const;
+    // Results of registration, with standard deviation bands if
+    // 'uncertainty'. Call after calcLimits().
+    DisplacementGrid displacements(bool uncertainty = false) const;
+    // Replace outliers in 'field' with the median of their neighbours,
+    // working on blocks of rows on the worker pool. Returns the number of
+    // cells replaced.
+    size_t regularize(DisplacementGrid& field, const RegularizeOptions& opts);
+    // Split [0, count) into ranges, run 'fn(begin, end)' on each on the
+    // worker pool and wait for them all. Ranges are disjoint, so, for
+    // example, tasks given ranges of rows may each write to their own rows
+    // of a shared DisplacementGrid.
+    void parallelFor(size_t count,
+        const std::function<void(size_t, size_t)>& fn);
+
+    // Pipelined registration for inputs sorted by row (Y), or by rows of
+    // tiles no more than 'band' cells tall. Once ingestion has moved more
+    // than 'band' rows past a row of cells, those cells can't receive any
+    // more points and are registered on the worker pool while ingestion
+    // continues. Not for adaptive cells.
+    void startPipeline(const RegistrationOptions& opts, int band);
+    void finishPipeline();
+
+    // Build the spatial index of scene 'order' of every cell (see
+    // GridCell::index()) on the worker pool, rather than on first use.
+    // Call once insertion is complete and before registration.
+    void buildIndex(AP::Order order);
+
+    // Write a record for each cell to 'writer' as soon as it's registered.
+    void setCellWriter(CellWriter *writer)
+        { m_cellWriter = writer; }
+    // Fill 'field', which must be the size of displacements(), as cells
+    // finish registration, and call 'done' with each of
+    // field.tiles(tileSize) once every cell in it has finished (on a
+    // worker, or at once for tiles without cells). Call after
+    // calcLimits(), for registration() (not the pipeline).
+    void setTileOutput(DisplacementGrid *field, size_t tileSize,
+        std::function<void(const DisplacementGrid::Tile&)> done);
+    // Write the results for the before points of each cell to 'writer' as
+    // soon as it's registered.
+    void setPointWriter(PointWriter *writer)
+        { m_pointWriter = writer; }
+    // Keep the memory held by cells' points to about 'bytes' (0 for no
+    // limit). While points are inserted, the cells that have gone longest
+    // without new points are written to a spill file in 'dir' (or the
+    // system's temporary directory) when the limit is passed. Spilled
+    // cells are reloaded to be registered, and no more cells are registered
+    // at once than fit in the limit, with their working memory. Call before
+    // inserting points. Spilled cells don't support buildIndex().
+    void setMemoryLimit(size_t bytes, const std::string& dir = "");
+    // Bytes of point data held in memory.
+    size_t heldBytes() const
+        { return m_held; }
+    // Bytes written to the spill file.
+    uint64_t spilledBytes() const
+        { return m_spill ? m_spill->size() : 0; }
 
+    int cellLength() const
+        { return m_len; }
+    // Number of cells, including those already registered and freed.
+    size_t size() const
+        { return m_cellCount; }
+    // Number of points inserted.
+    size_t pointCount() const
+        { return m_points; }
     size_t xSize()
         { return m_xSize; }
     size_t ySize()
@@ -111,48 +314,122 @@ public:
         { return m_yOrigin; }
 
 private:
+    // Holds 'bytes' of working memory under the memory limit (see admit())
+    // for as long as it lives.
+    class Admission
+    {
+    public:
+        Admission(Grid& grid, size_t bytes) : m_grid(grid), m_bytes(bytes)
+            { m_grid.admit(m_bytes); }
+        ~Admission()
+            { m_grid.discharge(m_bytes); }
+        Admission(const Admission&) = delete;
+        Admission& operator=(const Admission&) = delete;
+
+        // Release 'bytes' of points that load() has read into memory,
+        // which m_held now counts.
+        void loaded(size_t bytes)
+        {
+            bytes = (std::min)(bytes, m_bytes);
+            m_grid.discharge(bytes);
+            m_bytes -= bytes;
+        }
+
+    private:
+        Grid& m_grid;
+        size_t m_bytes;
+    };
+
+    GridCell& findCell(int x, int y);
+    void advance(int row);
+    void closeRows(int limit);
+    void submit(GridCell& cell);
+    bool split(GridCell& cell);
+    void mergeSparse();
+    void submitBlock(const std::vector<GridCell *>& cells,
+        const GridIndex& block, int level);
+    void flush();
+    void finish(GridCell& cell);
+    void reap();
+    void complete(const GridCell& cell);
+    void grown(size_t bytes);
+    void evict();
+    void spill(GridCell& cell);
+    size_t load(GridCell& cell);
+    size_t workingBytes(const GridCell& cell) const;
+    void admit(size_t bytes);
+    void discharge(size_t bytes);
+    void addTask(std::function<void()> task);
+    void await();
+    void wait();
+
     int m_len;
+    int m_threads;
     int m_xSize;
     int m_ySize;
     int m_xOrigin;
     int m_yOrigin;
-    std::unordered_map<GridIndex, GridCell> m_cells;
-    pdal::PointTable m_table;
-};
+    // Ordered by Morton code, so cells are registered and visited in a
+    // spatially coherent order. Cells are erased once registered (see
+    // reap()), so this holds only those being filled or registered.
+    std::map<GridIndex, GridCell> m_cells;
+    // Last cell found, which is usually the next one wanted.
+    GridCell *m_lastCell;
+    size_t m_points;
+    std::unique_ptr<pdal::ThreadPool> m_ownPool;
+    pdal::ThreadPool *m_pool;
+    std::vector<GridCell *> m_batch;
+    CellWriter *m_cellWriter;
+    PointWriter *m_pointWriter;
 
-class GridIter
-{
-public:
-    GridIter(Grid& grid, pdal::Dimension::Id dim);
-    using iterator_category = std::random_access_iterator_tag;
-    using difference_type = int32_t;
-    using value_type = double;
-    using pointer = double*;
-    using reference = double&;
+    // Tile output.
+    DisplacementGrid *m_field;
+    size_t m_tileSize;
+    size_t m_tilesAcross;
+    std::vector<DisplacementGrid::Tile> m_tiles;
+    // Cells of each tile that haven't finished.
+    std::unique_ptr<std::atomic<size_t>[]> m_tileCells;
+    std::function<void(const DisplacementGrid::Tile&)> m_tileDone;
 
-private:
-    Grid& m_grid;
-    uint64_t m_pos;
-    int m_dimOffset; // Offset to vector iterator.
+    // Results of finished cells, in the order they finished, and the cells
+    // to be erased from m_cells. Both filled by workers.
+    mutable std::mutex m_resultMutex;
+    std::vector<CellResult> m_results;
+    std::vector<GridIndex> m_finished;
+    // Number and extent of the cells ever created.
+    size_t m_cellCount;
+    int m_xMin;
+    int m_xMax;
+    int m_yMin;
+    int m_yMax;
 
-    int32_t x() const;
-    int32_t y() const;
+    // Tasks are tracked per grid, since the pool may be running tasks for
+    // other grids as well.
+    std::mutex m_taskMutex;
+    std::condition_variable m_taskDone;
+    size_t m_outstanding;
+    std::vector<std::string> m_errors;
 
-public:
-    GridIter& operator++();
-    GridIter operator++(int);
-    GridIter operator+(const difference_type& n) const;
-    GridIter& operator--();
-    GridIter operator--(int);
-    GridIter operator-(const difference_type& n) const;
-    bool operator==(const GridIter& other)
-        { return m_pos == other.m_pos; }
-    bool operator!=(const GridIter& other)
-        { return !(operator==(other)); }
-    const double& operator*() const;
-    double& operator*();
-    const double *operator->() const;
-    double *operator->();
+    // Memory limit. m_held counts the capacity of every cell's point
+    // lists (and those of the parts of split cells); m_working the
+    // estimated memory of the registrations under way, beyond that.
+    std::atomic<size_t> m_held;
+    size_t m_memoryLimit;
+    std::unique_ptr<SpillFile> m_spill;
+    uint64_t m_clock;
+    std::mutex m_memoryMutex;
+    std::condition_variable m_memoryFreed;
+    size_t m_working;
+
+    RegistrationOptions m_opts;
+
+    // Pipeline state.
+    bool m_pipelined;
+    int m_band;
+    int m_sweep;      // 1 when rows are ascending, -1 descending, 0 unknown.
+    int m_firstRow;
+    int m_frontRow;
+    std::map<int, std::vector<GridCell *>> m_openRows;
 };
 
 } // namespace
@@ -0,0 +1,147 @@
+#include "GridTable.hpp"
+
+#include <cstring>
+
+namespace AtlasProcessor
+{
+
+GridTable::GridTable(Grid& grid, AP::Order order,
+        pdal::point_count_t capacity, const PointFilter& filter) :
+    pdal::StreamPointTable(m_layout, capacity), m_grid(grid), m_order(order),
+    m_rowBegin((std::numeric_limits<int>::lowest)()),
+    m_rowEnd((std::numeric_limits<int>::max)()), m_direct(false),
+    m_filter(filter), m_filtered(filter.active())
+{}
+
+
+void GridTable::finalize()
+{
+    using namespace pdal::Dimension;
+
+    if (m_layout.finalized())
+        return;
+    pdal::BasePointTable::finalize();
+    m_buf.resize(pointsToBytes(capacity() + 1), '\0');
+
+    const Id dims[] { Id::X, Id::Y, Id::Z };
+    m_direct = true;
+    for (size_t d = 0; d < 3; ++d)
+    {
+        m_direct &= (m_layout.dimType(dims[d]) == Type::Double);
+        m_offsets[d] = m_layout.dimOffset(dims[d]);
+    }
+
+    m_class = field(Id::Classification, m_filter.usesClass());
+    m_return = field(Id::ReturnNumber, m_filter.usesReturns());
+    m_numReturns = field(Id::NumberOfReturns, m_filter.usesReturns());
+    m_intensity = field(Id::Intensity, m_filter.usesIntensity());
+}
+
+
+GridTable::Field GridTable::field(pdal::Dimension::Id dim, bool needed)
+{
+    Field f { 0, pdal::Dimension::Type::None };
+    if (!needed)
+        return f;
+    if (!m_layout.hasDim(dim))
+        throw pdal::pdal_error("Can't filter on " +
+            pdal::Dimension::name(dim) + ", which the input doesn't have.");
+    f.offset = m_layout.dimOffset(dim);
+    f.type = m_layout.dimType(dim);
+    return f;
+}
+
+
+double GridTable::value(const char *point, const Field& f) const
+{
+    using namespace pdal::Dimension;
+
+    const char *p = point + f.offset;
+    switch (f.type)
+    {
+    case Type::Unsigned8:
+        return *reinterpret_cast<const uint8_t *>(p);
+    case Type::Signed8:
+        return *reinterpret_cast<const int8_t *>(p);
+    case Type::Unsigned16:
+        { uint16_t v; std::memcpy(&v, p, sizeof(v)); return v; }
+    case Type::Signed16:
+        { int16_t v; std::memcpy(&v, p, sizeof(v)); return v; }
+    case Type::Unsigned32:
+        { uint32_t v; std::memcpy(&v, p, sizeof(v)); return v; }
+    case Type::Signed32:
+        { int32_t v; std::memcpy(&v, p, sizeof(v)); return v; }
+    case Type::Unsigned64:
+        { uint64_t v; std::memcpy(&v, p, sizeof(v)); return (double)v; }
+    case Type::Signed64:
+        { int64_t v; std::memcpy(&v, p, sizeof(v)); return (double)v; }
+    case Type::Float:
+        { float v; std::memcpy(&v, p, sizeof(v)); return v; }
+    case Type::Double:
+        { double v; std::memcpy(&v, p, sizeof(v)); return v; }
+    default:
+        return 0;
+    }
+}
+
+
+bool GridTable::keep(pdal::PointId idx)
+{
+    if (skip(idx))
+        return false;
+    if (!m_filtered)
+        return true;
+
+    const char *p = getPoint(idx);
+    return m_filter.keep((int)value(p, m_class), (int)value(p, m_return),
+        (int)value(p, m_numReturns), value(p, m_intensity));
+}
+
+
+// Called by the stream once the first numPoints() points have been filled
+// and passed through any filters.
+void GridTable::reset()
+{
+    pdal::PointId end = numPoints();
+
+    // Insert the runs of points that weren't removed by a pipeline filter
+    // (and so marked as skipped) or rejected by ours.
+    pdal::PointId i = 0;
+    while (i < end)
+    {
+        while (i < end && !keep(i))
+            i++;
+        pdal::PointId j = i;
+        while (j < end && keep(j))
+            j++;
+        if (j > i)
+            insert(i, j);
+        i = j;
+    }
+    std::fill(m_buf.begin(), m_buf.end(), '\0');
+}
+
+
+void GridTable::insert(pdal::PointId begin, pdal::PointId end)
+{
+    using namespace pdal::Dimension;
+
+    if (m_direct)
+    {
+        m_grid.insert(getPoint(begin), end - begin, pointsToBytes(1),
+            m_offsets, m_order, m_rowBegin, m_rowEnd);
+        return;
+    }
+
+    for (pdal::PointId i = begin; i < end; ++i)
+    {
+        pdal::PointRef p(*this, i);
+        double y = p.getFieldAs<double>(Id::Y);
+        int row = int(std::floor(y / m_grid.cellLength()));
+        if (row >= m_rowBegin && row < m_rowEnd)
+            m_grid.insert(p.getFieldAs<double>(Id::X), y,
+                p.getFieldAs<double>(Id::Z), m_order);
+    }
+}
+
+} // namespace AtlasProcessor
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <pdal/PointTable.hpp>
+
+#include "Grid.hpp"
+
+namespace AtlasProcessor
+{
+
+// Streaming point table that inserts each block of points into a grid as
+// soon as a reader has filled it. When X, Y and Z are stored as doubles,
+// which is the case for LAS and most other readers, they're read straight
+// from the table's memory a block at a time. Other layouts fall back to
+// converting each point's fields. Points rejected by the filter are dropped
+// in the same pass and never stored.
+class GridTable : public pdal::StreamPointTable
+{
+public:
+    GridTable(Grid& grid, AP::Order order, pdal::point_count_t capacity,
+        const PointFilter& filter = PointFilter());
+
+    // Insert only the points in rows [begin, end) of cells.
+    void setRows(int begin, int end)
+    {
+        m_rowBegin = begin;
+        m_rowEnd = end;
+    }
+
+    virtual void finalize();
+
+protected:
+    virtual void reset();
+    virtual char *getPoint(pdal::PointId idx)
+        { return m_buf.data() + pointsToBytes(idx); }
+
+private:
+    struct Field
+    {
+        size_t offset;
+        pdal::Dimension::Type type;
+    };
+
+    Field field(pdal::Dimension::Id dim, bool needed);
+    double value(const char *point, const Field& f) const;
+    bool keep(pdal::PointId idx);
+    void insert(pdal::PointId begin, pdal::PointId end);
+
+    pdal::PointLayout m_layout;
+    std::vector<char> m_buf;
+    Grid& m_grid;
+    AP::Order m_order;
+    int m_rowBegin;
+    int m_rowEnd;
+    bool m_direct;
+    size_t m_offsets[3];
+    PointFilter m_filter;
+    bool m_filtered;
+    Field m_class;
+    Field m_return;
+    Field m_numReturns;
+    Field m_intensity;
+};
+
+} // namespace AtlasProcessor
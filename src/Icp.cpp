@@ -0,0 +1,199 @@
+#include "Icp.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+namespace AtlasProcessor
+{
+
+namespace
+{
+
+using Matrix6d = Eigen::Matrix<double, 6, 6>;
+using Vector6d = Eigen::Matrix<double, 6, 1>;
+
+// Fewer points or pairs than this can't determine a transform.
+const size_t MinPairs = 12;
+// Neighbours used to estimate a normal.
+const size_t NormalNeighbours = 10;
+// Default convergence limit on the movement, relative to the spread of the
+// points, of the update of an iteration.
+const double DefaultTolerance = 1e-6;
+// Smallest ratio of the smallest to the largest eigenvalue of the normal
+// equations for which the problem is considered well posed.
+const double MinConditioning = 1e-3;
+
+struct Pair
+{
+    double dist2;
+    size_t moving;
+    size_t fixed;
+};
+
+} // unnamed namespace
+
+TrimmedIcp::TrimmedIcp(const RegistrationOptions& opts) : m_opts(opts)
+{}
+
+
+TrimmedIcp::Result TrimmedIcp::run(const PointList& fixed,
+    const PointList& moving, const KdTree *index, const Eigen::Matrix4d *start)
+{
+    using namespace Eigen;
+
+    Result r;
+    r.transform = Matrix4d::Identity();
+    r.residual = 0;
+    r.iterations = 0;
+    r.converged = false;
+    r.wellPosed = false;
+    r.valid = false;
+    if (fixed.size() < MinPairs || moving.size() < MinPairs)
+        return r;
+
+    Vector3d mean = Vector3d::Zero();
+    for (const Vector3d& p : fixed)
+        mean += p;
+    mean /= (double)fixed.size();
+    double sq = 0;
+    for (const Vector3d& p : fixed)
+        sq += (p - mean).squaredNorm();
+    double scale = std::sqrt(sq / fixed.size());
+    if (scale == 0)
+        return r;
+
+    if (!index)
+    {
+        m_tree.build(fixed);
+        index = &m_tree;
+    }
+    m_fixed.resize(fixed.size());
+    for (size_t i = 0; i < fixed.size(); ++i)
+        m_fixed[i] = (fixed[i] - mean) / scale;
+    normals(fixed, *index);
+
+    PointList src(moving.size());
+    for (size_t i = 0; i < moving.size(); ++i)
+        src[i] = (moving[i] - mean) / scale;
+
+    double tolerance = m_opts.transformTolerance > 0 ?
+        m_opts.transformTolerance / scale : DefaultTolerance;
+    size_t keep = (std::max)(MinPairs,
+        (size_t)(m_opts.icpTrim * src.size()));
+    keep = (std::min)(keep, src.size());
+
+    // With fixed = R * moving + t, the normalized translation is
+    // (R * mean + t - mean) / scale.
+    Matrix3d rot = Matrix3d::Identity();
+    Vector3d trans = Vector3d::Zero();
+    if (start)
+    {
+        rot = start->topLeftCorner<3, 3>();
+        trans = (rot * mean + start->topRightCorner<3, 1>() - mean) / scale;
+    }
+    std::vector<Pair> pairs(src.size());
+    Matrix6d a;
+    Vector6d b;
+    double sumE2;
+
+    // Pair the points under the current transform, trim the pairs and
+    // accumulate the normal equations of the kept pairs. The index is in
+    // scene coordinates.
+    auto accumulate = [&]()
+    {
+        for (size_t i = 0; i < src.size(); ++i)
+        {
+            Pair& p = pairs[i];
+            p.moving = i;
+            p.fixed = index->nearest((rot * src[i] + trans) * scale + mean,
+                p.dist2);
+        }
+        if (keep < pairs.size())
+            std::nth_element(pairs.begin(), pairs.begin() + keep,
+                pairs.end(), [](const Pair& p1, const Pair& p2)
+                { return p1.dist2 < p2.dist2; });
+
+        a.setZero();
+        b.setZero();
+        sumE2 = 0;
+        for (size_t k = 0; k < keep; ++k)
+        {
+            const Pair& p = pairs[k];
+            Vector3d q = rot * src[p.moving] + trans;
+            const Vector3d& n = m_normals[p.fixed];
+            Vector6d row;
+            row << q.cross(n), n;
+            double e = n.dot(q - m_fixed[p.fixed]);
+            a.noalias() += row * row.transpose();
+            b -= row * e;
+            sumE2 += e * e;
+        }
+    };
+
+    while (r.iterations < m_opts.icpIterations)
+    {
+        accumulate();
+        Vector6d x = a.ldlt().solve(b);
+        if (!x.allFinite())
+            return r;
+
+        // Apply the update: a small rotation 'omega' then a translation.
+        Vector3d omega = x.head<3>();
+        double angle = omega.norm();
+        Matrix3d dr = angle > 0 ?
+            AngleAxisd(angle, omega / angle).toRotationMatrix() :
+            Matrix3d::Identity();
+        rot = dr * rot;
+        trans = dr * trans + x.tail<3>();
+        r.iterations++;
+
+        if (angle + x.tail<3>().norm() < tolerance)
+        {
+            r.converged = true;
+            break;
+        }
+    }
+
+    // Residual and conditioning at the final transform.
+    accumulate();
+    SelfAdjointEigenSolver<Matrix6d> es(a, EigenvaluesOnly);
+    r.wellPosed = es.eigenvalues()(0) > MinConditioning * es.eigenvalues()(5);
+    r.residual = std::sqrt(sumE2 / keep) * scale;
+
+    // Undo the normalization: fixed = rot * moving + (scale * trans +
+    // mean - rot * mean).
+    r.transform.topLeftCorner<3, 3>() = rot;
+    r.transform.topRightCorner<3, 1>() = scale * trans + mean - rot * mean;
+    r.valid = r.wellPosed;
+    return r;
+}
+
+
+// Estimate the normal of each fixed point as the direction of least
+// variance of its nearest neighbours.
+void TrimmedIcp::normals(const PointList& fixed, const KdTree& index)
+{
+    using namespace Eigen;
+
+    m_normals.resize(fixed.size());
+    std::vector<size_t> neighbours;
+    for (size_t i = 0; i < fixed.size(); ++i)
+    {
+        index.nearest(fixed[i], NormalNeighbours, neighbours);
+
+        Vector3d mean = Vector3d::Zero();
+        for (size_t j : neighbours)
+            mean += fixed[j];
+        mean /= (double)neighbours.size();
+        Matrix3d cov = Matrix3d::Zero();
+        for (size_t j : neighbours)
+        {
+            Vector3d d = fixed[j] - mean;
+            cov += d * d.transpose();
+        }
+        SelfAdjointEigenSolver<Matrix3d> es(cov);
+        m_normals[i] = es.eigenvectors().col(0);
+    }
+}
+
+} // namespace AtlasProcessor
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <Eigen/Dense>
+
+#include "KdTree.hpp"
+#include "Types.hpp"
+
+namespace AtlasProcessor
+{
+
+// Trimmed point-to-plane ICP.
+//
+// Each iteration pairs every moving point with its nearest fixed point,
+// drops the pairs farthest apart (keeping the fraction 'icpTrim' of
+// RegistrationOptions) and solves the linearized point-to-plane problem
+// for a small rotation and translation. Normals are those of the fixed
+// points, from their nearest neighbours. The transform is solved for in
+// coordinates centered on the fixed points and scaled to unit RMS spread.
+//
+// ICP starts from the identity (or a given transform), so it's only
+// suitable for small motion relative to the cell. On surfaces without
+// enough relief (e.g. a flat cell) motion within the surface can't be
+// determined; such results are reported as ill posed.
+class TrimmedIcp
+{
+public:
+    struct Result
+    {
+        // Transform that maps the moving points onto the fixed points.
+        Eigen::Matrix4d transform;
+        // RMS point-to-plane distance of the kept pairs, in scene units.
+        double residual;
+        size_t iterations;
+        bool converged;
+        // False when the surface doesn't constrain every degree of freedom.
+        bool wellPosed;
+        bool valid;
+    };
+
+    TrimmedIcp(const RegistrationOptions& opts);
+
+    // 'index', if given, is an index of 'fixed'. Otherwise one is built.
+    // 'start', if given, is the transform to start from.
+    Result run(const PointList& fixed, const PointList& moving,
+        const KdTree *index = nullptr, const Eigen::Matrix4d *start = nullptr);
+
+private:
+    void normals(const PointList& fixed, const KdTree& index);
+
+    RegistrationOptions m_opts;
+    KdTree m_tree;
+    PointList m_fixed;      // Normalized.
+    PointList m_normals;
+};
+
+} // namespace AtlasProcessor
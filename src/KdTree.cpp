@@ -0,0 +1,185 @@
+#include "KdTree.hpp"
+
+#include <algorithm>
+#include <numeric>
+
+namespace AtlasProcessor
+{
+
+namespace
+{
+
+// Ranges this small aren't split.
+const size_t LeafSize = 8;
+
+} // unnamed namespace
+
+KdTree::KdTree()
+{}
+
+
+KdTree::KdTree(const PointList& points)
+{
+    build(points);
+}
+
+
+void KdTree::build(const PointList& points)
+{
+    m_points = points;
+    m_index.resize(points.size());
+    std::iota(m_index.begin(), m_index.end(), 0);
+    m_axis.assign(points.size(), 0);
+    build(0, points.size());
+
+    // m_points was only used for its coordinates while building.
+    for (size_t i = 0; i < m_index.size(); ++i)
+        m_points[i] = points[m_index[i]];
+}
+
+
+// Arrange the indices of [begin, end) around the median of its widest
+// axis. Only m_index is reordered.
+void KdTree::build(size_t begin, size_t end)
+{
+    if (end - begin <= LeafSize)
+        return;
+
+    Eigen::Vector3d lo = m_points[m_index[begin]];
+    Eigen::Vector3d hi = lo;
+    for (size_t i = begin + 1; i < end; ++i)
+    {
+        lo = lo.cwiseMin(m_points[m_index[i]]);
+        hi = hi.cwiseMax(m_points[m_index[i]]);
+    }
+    int axis;
+    (hi - lo).maxCoeff(&axis);
+
+    size_t mid = begin + (end - begin) / 2;
+    std::nth_element(m_index.begin() + begin, m_index.begin() + mid,
+        m_index.begin() + end, [this, axis](size_t a, size_t b)
+        { return m_points[a](axis) < m_points[b](axis); });
+    m_axis[mid] = (uint8_t)axis;
+
+    build(begin, mid);
+    build(mid + 1, end);
+}
+
+
+size_t KdTree::nearest(const Eigen::Vector3d& p, double& dist2,
+    double maxDist2) const
+{
+    Neighbour best(maxDist2, size());
+    search(0, size(), p, best);
+    if (best.second == size())
+        return size();
+    dist2 = best.first;
+    return m_index[best.second];
+}
+
+
+void KdTree::search(size_t begin, size_t end, const Eigen::Vector3d& p,
+    Neighbour& best) const
+{
+    if (end - begin <= LeafSize)
+    {
+        for (size_t i = begin; i < end; ++i)
+        {
+            double d2 = (m_points[i] - p).squaredNorm();
+            if (d2 <= best.first)
+                best = Neighbour(d2, i);
+        }
+        return;
+    }
+
+    size_t mid = begin + (end - begin) / 2;
+    double d2 = (m_points[mid] - p).squaredNorm();
+    if (d2 <= best.first)
+        best = Neighbour(d2, mid);
+
+    // Search the side that holds 'p' first, then the other side if it can
+    // be closer than the best so far.
+    double diff = p(m_axis[mid]) - m_points[mid](m_axis[mid]);
+    if (diff < 0)
+    {
+        search(begin, mid, p, best);
+        if (diff * diff <= best.first)
+            search(mid + 1, end, p, best);
+    }
+    else
+    {
+        search(mid + 1, end, p, best);
+        if (diff * diff <= best.first)
+            search(begin, mid, p, best);
+    }
+}
+
+
+void KdTree::nearest(const Eigen::Vector3d& p, size_t k,
+    std::vector<size_t>& out) const
+{
+    out.clear();
+    if (k == 0)
+        return;
+
+    // Max-heap on distance of the best 'k' so far.
+    std::vector<Neighbour> heap;
+    heap.reserve(k + 1);
+    search(0, size(), p, k, heap);
+
+    std::sort_heap(heap.begin(), heap.end());
+    for (const Neighbour& n : heap)
+        out.push_back(m_index[n.second]);
+}
+
+
+void KdTree::search(size_t begin, size_t end, const Eigen::Vector3d& p,
+    size_t k, std::vector<Neighbour>& heap) const
+{
+    auto visit = [&](size_t i)
+    {
+        double d2 = (m_points[i] - p).squaredNorm();
+        if (heap.size() < k)
+        {
+            heap.emplace_back(d2, i);
+            std::push_heap(heap.begin(), heap.end());
+        }
+        else if (d2 < heap.front().first)
+        {
+            std::pop_heap(heap.begin(), heap.end());
+            heap.back() = Neighbour(d2, i);
+            std::push_heap(heap.begin(), heap.end());
+        }
+    };
+    auto bound = [&]()
+    {
+        return heap.size() < k ? (std::numeric_limits<double>::max)() :
+            heap.front().first;
+    };
+
+    if (end - begin <= LeafSize)
+    {
+        for (size_t i = begin; i < end; ++i)
+            visit(i);
+        return;
+    }
+
+    size_t mid = begin + (end - begin) / 2;
+    visit(mid);
+
+    double diff = p(m_axis[mid]) - m_points[mid](m_axis[mid]);
+    if (diff < 0)
+    {
+        search(begin, mid, p, k, heap);
+        if (diff * diff <= bound())
+            search(mid + 1, end, p, k, heap);
+    }
+    else
+    {
+        search(mid + 1, end, p, k, heap);
+        if (diff * diff <= bound())
+            search(begin, mid, p, k, heap);
+    }
+}
+
+} // namespace AtlasProcessor
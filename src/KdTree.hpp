@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include <Eigen/Dense>
+
+#include "Types.hpp"
+
+namespace AtlasProcessor
+{
+
+// Static 3D k-d tree over a point list, for nearest neighbour queries.
+//
+// The tree is implicit: points are copied and reordered so that each
+// node's point is the median of its range along the range's widest axis,
+// with the lower half of the range before it and the upper half after.
+// Small ranges are leaves that are scanned. Queries don't modify the tree,
+// so any number of threads may query it at once.
+class KdTree
+{
+public:
+    KdTree();
+    explicit KdTree(const PointList& points);
+
+    void build(const PointList& points);
+
+    size_t size() const
+        { return m_points.size(); }
+    bool empty() const
+        { return m_points.empty(); }
+
+    // Index, in the list the tree was built from, of the point nearest to
+    // 'p' that lies within sqrt(maxDist2) of it, or size() if there is
+    // none. Sets 'dist2' to its squared distance.
+    size_t nearest(const Eigen::Vector3d& p, double& dist2,
+        double maxDist2 = (std::numeric_limits<double>::max)()) const;
+
+    // Indices of the (up to) 'k' points nearest to 'p', nearest first.
+    void nearest(const Eigen::Vector3d& p, size_t k,
+        std::vector<size_t>& out) const;
+
+private:
+    using Neighbour = std::pair<double, size_t>;    // dist2, position.
+
+    void build(size_t begin, size_t end);
+    void search(size_t begin, size_t end, const Eigen::Vector3d& p,
+        Neighbour& best) const;
+    void search(size_t begin, size_t end, const Eigen::Vector3d& p,
+        size_t k, std::vector<Neighbour>& heap) const;
+
+    PointList m_points;             // In tree order.
+    std::vector<size_t> m_index;    // Original index of each point.
+    std::vector<uint8_t> m_axis;    // Split axis of each node.
+};
+
+} // namespace AtlasProcessor
@@ -0,0 +1,296 @@
+#include "PointWriter.hpp"
+
+#include <cstring>
+#include <fstream>
+#include <functional>
+
+#include <pdal/PointTable.hpp>
+#include <pdal/Reader.hpp>
+#include <pdal/StageFactory.hpp>
+#include <pdal/Streamable.hpp>
+#include <pdal/util/FileUtils.hpp>
+#include <pdal/util/Utils.hpp>
+
+namespace AtlasProcessor
+{
+
+namespace
+{
+
+// Records that may wait to be written before write() blocks (64 MiB).
+const size_t MaxQueued = (64 << 20) / sizeof(PointRecord);
+
+// Binary table: a 64-byte header followed by the records.
+struct BinaryHeader
+{
+    char magic[8];          // "ATLASPTS"
+    uint32_t version;
+    uint32_t recordSize;    // sizeof(PointRecord)
+    uint64_t count;         // Number of records.
+    char reserved[40];
+};
+static_assert(sizeof(BinaryHeader) == 64, "Unexpected binary header size");
+static_assert(sizeof(PointRecord) == 48, "Unexpected point record size");
+
+class BinaryPointWriter : public PointWriter
+{
+public:
+    BinaryPointWriter(const std::string& filename) : m_filename(filename),
+        m_out(filename, std::ios::binary | std::ios::trunc)
+    {
+        if (!m_out)
+            throw pdal::pdal_error("Unable to create '" + filename + "'.");
+
+        std::memset(&m_header, 0, sizeof(m_header));
+        std::memcpy(m_header.magic, "ATLASPTS", sizeof(m_header.magic));
+        m_header.version = 1;
+        m_header.recordSize = sizeof(PointRecord);
+        m_out.write(reinterpret_cast<const char *>(&m_header),
+            sizeof(m_header));
+        start();
+    }
+
+    ~BinaryPointWriter()
+        { stop(); }
+
+protected:
+    // The count isn't known until the end, so the header is rewritten.
+    virtual void run()
+    {
+        std::vector<PointRecord> block;
+        while (next(block))
+        {
+            m_out.write(reinterpret_cast<const char *>(block.data()),
+                block.size() * sizeof(PointRecord));
+            m_header.count += block.size();
+        }
+        m_out.seekp(0);
+        m_out.write(reinterpret_cast<const char *>(&m_header),
+            sizeof(m_header));
+        m_out.close();
+        if (!m_out)
+            throw pdal::pdal_error("Error writing '" + m_filename + "'.");
+    }
+
+private:
+    std::string m_filename;
+    std::ofstream m_out;
+    BinaryHeader m_header;
+};
+
+
+// Streaming reader of the blocks handed to a PointWriter.
+class RecordReader : public pdal::Reader, public pdal::Streamable
+{
+public:
+    using Source = std::function<bool(std::vector<PointRecord>&)>;
+
+    RecordReader(Source source) : m_source(source), m_pos(0)
+    {}
+
+    std::string getName() const
+        { return "readers.atlaspoints"; }
+
+private:
+    virtual void addDimensions(pdal::PointLayoutPtr layout)
+    {
+        using namespace pdal::Dimension;
+
+        layout->registerDims({ Id::X, Id::Y, Id::Z });
+        m_dims[0] = layout->registerOrAssignDim("DisplacementX", Type::Float);
+        m_dims[1] = layout->registerOrAssignDim("DisplacementY", Type::Float);
+        m_dims[2] = layout->registerOrAssignDim("DisplacementZ", Type::Float);
+        m_dims[3] = layout->registerOrAssignDim("Residual", Type::Float);
+    }
+
+    virtual bool processOne(pdal::PointRef& point)
+    {
+        using namespace pdal::Dimension;
+
+        while (m_pos == m_block.size())
+        {
+            m_pos = 0;
+            if (!m_source(m_block))
+                return false;
+        }
+
+        const PointRecord& r = m_block[m_pos++];
+        point.setField(Id::X, r.position[0]);
+        point.setField(Id::Y, r.position[1]);
+        point.setField(Id::Z, r.position[2]);
+        for (int d = 0; d < 3; ++d)
+            point.setField(m_dims[d], r.displacement[d]);
+        point.setField(m_dims[3], r.residual);
+        return true;
+    }
+
+    Source m_source;
+    std::vector<PointRecord> m_block;
+    size_t m_pos;
+    pdal::Dimension::Id m_dims[4];
+};
+
+
+// LAS/LAZ, written by PDAL in stream mode.
+class LasPointWriter : public PointWriter
+{
+public:
+    LasPointWriter(const std::string& filename, const std::string& srs) :
+        m_filename(filename), m_srs(srs)
+    {
+        start();
+    }
+
+    ~LasPointWriter()
+        { stop(); }
+
+protected:
+    virtual void run()
+    {
+        using namespace pdal;
+
+        RecordReader reader([this](std::vector<PointRecord>& block)
+            { return next(block); });
+
+        StageFactory factory;
+        Stage *writer = factory.createStage("writers.las");
+        if (!writer)
+            throw pdal_error("PDAL's LAS writer isn't available to write '" +
+                m_filename + "'.");
+
+        Options opts;
+        opts.add("filename", m_filename);
+        opts.add("a_srs", m_srs);
+        opts.add("minor_version", 4);
+        opts.add("extra_dims", "all");
+        opts.add("scale_x", 0.001);
+        opts.add("scale_y", 0.001);
+        opts.add("scale_z", 0.001);
+        opts.add("offset_x", "auto");
+        opts.add("offset_y", "auto");
+        opts.add("offset_z", "auto");
+        if (Utils::tolower(FileUtils::extension(m_filename)) == ".laz")
+            opts.add("compression", "true");
+        writer->setOptions(opts);
+        writer->setInput(reader);
+
+        FixedPointTable table(10000);
+        writer->prepare(table);
+        writer->execute(table);
+    }
+
+private:
+    std::string m_filename;
+    std::string m_srs;
+};
+
+} // unnamed namespace
+
+PointWriter::PointWriter() : m_queued(0), m_closed(false), m_done(false)
+{}
+
+
+PointWriter::~PointWriter()
+{}
+
+
+std::unique_ptr<PointWriter> PointWriter::create(const std::string& filename,
+    const std::string& srs)
+{
+    std::string ext =
+        pdal::Utils::tolower(pdal::FileUtils::extension(filename));
+
+    std::unique_ptr<PointWriter> w;
+    if (ext == ".bin")
+        w.reset(new BinaryPointWriter(filename));
+    else if (ext == ".las" || ext == ".laz")
+        w.reset(new LasPointWriter(filename, srs));
+    else
+        throw pdal::pdal_error("Can't determine the format of '" + filename +
+            "' from its extension.");
+    return w;
+}
+
+
+void PointWriter::start()
+{
+    m_thread = std::thread([this]()
+    {
+        std::string error;
+        try
+        {
+            run();
+        }
+        catch (const std::exception& err)
+        {
+            error = err.what();
+        }
+
+        // Nothing more will be taken, so drop anything still queued to
+        // keep writers from waiting for space that will never come.
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_error = error;
+        m_done = true;
+        m_queue.clear();
+        m_queued = 0;
+        m_changed.notify_all();
+    });
+}
+
+
+void PointWriter::stop()
+{
+    if (!m_thread.joinable())
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_closed = true;
+        m_changed.notify_all();
+    }
+    m_thread.join();
+}
+
+
+void PointWriter::write(std::vector<PointRecord>&& block)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_changed.wait(lock, [this]()
+        { return m_queued < MaxQueued || m_done; });
+    if (m_error.size())
+        throw pdal::pdal_error(m_error);
+    if (m_closed || m_done)
+        return;
+
+    m_queued += block.size();
+    m_queue.push_back(std::move(block));
+    m_changed.notify_all();
+}
+
+
+bool PointWriter::next(std::vector<PointRecord>& block)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_changed.wait(lock, [this]()
+        { return m_queue.size() || m_closed; });
+    if (m_queue.empty())
+        return false;
+
+    block = std::move(m_queue.front());
+    m_queue.pop_front();
+    m_queued -= block.size();
+    m_changed.notify_all();
+    return true;
+}
+
+
+void PointWriter::close()
+{
+    stop();
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_error.size())
+        throw pdal::pdal_error(m_error);
+}
+
+} // namespace AtlasProcessor
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace AtlasProcessor
+{
+
+// Result of registration for one point of the before scene. The layout is
+// fixed and free of padding, so a binary table of these can be
+// memory-mapped.
+struct PointRecord
+{
+    double position[3];
+    float displacement[3];  // By the cell's transform.
+    // Distance from the displaced point to the nearest point of the after
+    // scene in its cell, or NaN if there's none.
+    float residual;
+    int32_t cellX;
+    int32_t cellY;
+};
+
+// Writes per-point results on a thread of its own. Workers hand over a
+// block of records per cell with write(), which returns at once unless
+// more than a bounded amount of data is waiting to be written, in which
+// case it waits for the writer to catch up.
+class PointWriter
+{
+public:
+    virtual ~PointWriter();
+
+    // Create a writer for 'filename', chosen by its extension: ".bin" for
+    // a binary table, ".las" or ".laz" for a point cloud with the
+    // displacement and residual as extra dimensions. Throws
+    // pdal::pdal_error on failure.
+    static std::unique_ptr<PointWriter> create(const std::string& filename,
+        const std::string& srs);
+
+    // May be called from any thread. Throws if the writer has failed.
+    void write(std::vector<PointRecord>&& block);
+    // Write everything queued and complete the file. Throws if the writer
+    // failed.
+    void close();
+
+protected:
+    PointWriter();
+
+    // Start the writer thread, which calls run(). Called by subclasses
+    // once they're constructed.
+    void start();
+    // Wait for the writer thread to finish. Subclasses call this from their
+    // destructors, as run() uses their members.
+    void stop();
+
+    // Called on the writer thread. Writes the blocks returned by next().
+    virtual void run() = 0;
+    // Take the next block into 'block', waiting for one if need be.
+    // Returns false once the writer is closed and every block is taken.
+    bool next(std::vector<PointRecord>& block);
+
+private:
+    std::thread m_thread;
+    std::mutex m_mutex;
+    std::condition_variable m_changed;
+    std::deque<std::vector<PointRecord>> m_queue;
+    size_t m_queued;        // Number of records in m_queue.
+    bool m_closed;
+    bool m_done;            // The writer thread has finished.
+    std::string m_error;
+};
+
+} // namespace AtlasProcessor
@@ -0,0 +1,191 @@
+#include "RasterWriter.hpp"
+
+#include <array>
+
+#include <gdal.h>
+#include <ogr_srs_api.h>
+
+#include <pdal/PointView.hpp>
+
+namespace AtlasProcessor
+{
+
+const size_t RasterWriter::TileSize;
+
+RasterWriter::RasterWriter(const std::string& filename,
+        const DisplacementGrid& field, const std::string& srs) :
+    m_field(field), m_ds(nullptr), m_bandCount(field.hasStd() ? 6 : 3),
+    m_closed(false), m_done(false)
+{
+    GDALAllRegister();
+    GDALDriverH driver = GDALGetDriverByName("GTiff");
+    if (!driver)
+        throw pdal::pdal_error("GDAL's GTiff driver isn't available to "
+            "write '" + filename + "'.");
+
+    std::string block = std::to_string(TileSize);
+    std::string blockX = "BLOCKXSIZE=" + block;
+    std::string blockY = "BLOCKYSIZE=" + block;
+    const char *options[] { "TILED=YES", blockX.c_str(), blockY.c_str(),
+        "BIGTIFF=IF_SAFER", nullptr };
+    m_ds = GDALCreate(driver, filename.c_str(), (int)field.xSize(),
+        (int)field.ySize(), m_bandCount + 1, GDT_Float32,
+        const_cast<char **>(options));
+    if (!m_ds)
+        throw pdal::pdal_error("Unable to create '" + filename + "'.");
+
+    std::array<double, 6> transform = field.geoTransform();
+    GDALSetGeoTransform(m_ds, transform.data());
+    OGRSpatialReferenceH ref = OSRNewSpatialReference(nullptr);
+    char *wkt = nullptr;
+    if (OSRSetFromUserInput(ref, srs.c_str()) == OGRERR_NONE &&
+            OSRExportToWkt(ref, &wkt) == OGRERR_NONE)
+        GDALSetProjection(m_ds, wkt);
+    CPLFree(wkt);
+    OSRRelease(ref);
+
+    const char *names[] { "X", "Y", "Z", "StdX", "StdY", "StdZ" };
+    for (int b = 0; b < m_bandCount; ++b)
+    {
+        GDALRasterBandH band = GDALGetRasterBand(m_ds, b + 1);
+        GDALSetRasterNoDataValue(band, DisplacementGrid::NoData);
+        GDALSetDescription(band, names[b]);
+    }
+    GDALSetDescription(GDALGetRasterBand(m_ds, m_bandCount + 1), "Flags");
+
+    for (Buffer& buf : m_buffers)
+        m_free.push_back(&buf);
+    m_thread = std::thread(&RasterWriter::run, this);
+}
+
+
+RasterWriter::~RasterWriter()
+{
+    stop();
+    if (m_ds)
+        GDALClose(m_ds);
+}
+
+
+void RasterWriter::write(const DisplacementGrid::Tile& tile)
+{
+    Buffer *buf;
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_changed.wait(lock, [this](){ return m_free.size() || m_done; });
+        if (m_error.size())
+            throw pdal::pdal_error(m_error);
+        if (m_closed || m_done)
+            return;
+        buf = m_free.front();
+        m_free.pop_front();
+    }
+
+    // Copy outside of the lock, so that several threads can copy at once.
+    buf->tile = tile;
+    for (int b = 0; b < m_bandCount; ++b)
+    {
+        std::vector<float>& band = buf->bands[b];
+        band.resize(tile.cols * tile.rows);
+        for (size_t r = 0; r < tile.rows; ++r)
+        {
+            const double *src = (b < 3 ? m_field.row(b, tile.row + r) :
+                m_field.stdRow(b - 3, tile.row + r)) + tile.col;
+            std::copy(src, src + tile.cols, band.data() + r * tile.cols);
+        }
+    }
+    buf->flags.resize(tile.cols * tile.rows);
+    for (size_t r = 0; r < tile.rows; ++r)
+    {
+        const unsigned *src = m_field.flagRow(tile.row + r) + tile.col;
+        std::copy(src, src + tile.cols, buf->flags.data() + r * tile.cols);
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_ready.push_back(buf);
+    m_changed.notify_all();
+}
+
+
+// Writer thread.
+void RasterWriter::run()
+{
+    std::string error;
+    while (true)
+    {
+        Buffer *buf;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_changed.wait(lock, [this]()
+                { return m_ready.size() || m_closed; });
+            if (m_ready.empty())
+                break;
+            buf = m_ready.front();
+            m_ready.pop_front();
+        }
+
+        const DisplacementGrid::Tile& t = buf->tile;
+        for (int b = 0; b < m_bandCount && error.empty(); ++b)
+        {
+            GDALRasterBandH band = GDALGetRasterBand(m_ds, b + 1);
+            if (GDALRasterIO(band, GF_Write, (int)t.col, (int)t.row,
+                    (int)t.cols, (int)t.rows, buf->bands[b].data(),
+                    (int)t.cols, (int)t.rows, GDT_Float32, 0, 0) != CE_None)
+                error = "Unable to write raster tile at column " +
+                    std::to_string(t.col) + ", row " + std::to_string(t.row) +
+                    ": " + CPLGetLastErrorMsg();
+        }
+        if (error.empty())
+        {
+            GDALRasterBandH band = GDALGetRasterBand(m_ds, m_bandCount + 1);
+            if (GDALRasterIO(band, GF_Write, (int)t.col, (int)t.row,
+                    (int)t.cols, (int)t.rows, buf->flags.data(),
+                    (int)t.cols, (int)t.rows, GDT_UInt16, 0, 0) != CE_None)
+                error = "Unable to write raster flags at column " +
+                    std::to_string(t.col) + ", row " + std::to_string(t.row) +
+                    ": " + CPLGetLastErrorMsg();
+        }
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_free.push_back(buf);
+        m_changed.notify_all();
+        if (error.size())
+            break;
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_error = error;
+    m_done = true;
+    m_changed.notify_all();
+}
+
+
+void RasterWriter::stop()
+{
+    if (!m_thread.joinable())
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_closed = true;
+        m_changed.notify_all();
+    }
+    m_thread.join();
+}
+
+
+void RasterWriter::close()
+{
+    stop();
+    if (m_ds)
+    {
+        GDALClose(m_ds);
+        m_ds = nullptr;
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_error.size())
+        throw pdal::pdal_error(m_error);
+}
+
+} // namespace AtlasProcessor
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "DisplacementGrid.hpp"
+
+namespace AtlasProcessor
+{
+
+// Writes a DisplacementGrid to a tiled GeoTIFF of X, Y and Z bands (then
+// StdX, StdY and StdZ, if the grid has them) and a last band of each cell's
+// CellFlag values, Flags, on a thread of its own, a tile at a time, so that
+// tiles can be written while the rest of the grid is still being computed.
+//
+// GeoTIFF bands share a data type, so Flags is stored as Float32, which
+// holds every combination of flags exactly.
+//
+// write() copies a tile into one of two buffers and returns; the writer
+// thread writes each buffer and hands it back. With both buffers waiting
+// to be written, write() waits.
+class RasterWriter
+{
+public:
+    // Tiles passed to write() should be those of field.tiles(TileSize),
+    // which match the GeoTIFF's blocks.
+    static const size_t TileSize = 256;
+
+    // Create 'filename' for 'field', whose values are read by write().
+    // Throws pdal::pdal_error on failure.
+    RasterWriter(const std::string& filename, const DisplacementGrid& field,
+        const std::string& srs);
+    ~RasterWriter();
+
+    // Queue 'tile' of the field, whose cells must be final. May be called
+    // from any thread. Throws if the writer has failed.
+    void write(const DisplacementGrid::Tile& tile);
+    // Write everything queued and close the file. Throws if the writer
+    // failed.
+    void close();
+
+private:
+    struct Buffer
+    {
+        DisplacementGrid::Tile tile;
+        std::vector<float> bands[6];
+        std::vector<uint16_t> flags;
+    };
+
+    void run();
+    void stop();
+
+    const DisplacementGrid& m_field;
+    void *m_ds;         // GDALDatasetH
+    int m_bandCount;    // Not counting Flags.
+    Buffer m_buffers[2];
+    std::thread m_thread;
+    std::mutex m_mutex;
+    std::condition_variable m_changed;
+    std::deque<Buffer *> m_free;
+    std::deque<Buffer *> m_ready;
+    bool m_closed;
+    bool m_done;        // The writer thread has finished.
+    std::string m_error;
+};
+
+} // namespace AtlasProcessor
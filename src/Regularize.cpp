@@ -0,0 +1,81 @@
+#include "Regularize.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+namespace AtlasProcessor
+{
+
+namespace
+{
+
+double median(std::vector<double>& v)
+{
+    size_t mid = v.size() / 2;
+    std::nth_element(v.begin(), v.begin() + mid, v.end());
+    double m = v[mid];
+    if (v.size() % 2 == 0)
+        m = (m + *std::max_element(v.begin(), v.begin() + mid)) / 2;
+    return m;
+}
+
+} // unnamed namespace
+
+size_t regularizeRows(const DisplacementGrid& in, DisplacementGrid& out,
+    size_t begin, size_t end, const RegularizeOptions& opts)
+{
+    const int radius = (std::max)(opts.radius, 1);
+    // A median needs at least one value.
+    const int minNeighbours = (std::max)(opts.minNeighbours, 1);
+
+    size_t replaced = 0;
+    std::vector<Eigen::Vector3d> neighbours;
+    std::vector<double> values;
+    for (size_t row = begin; row < end; ++row)
+        for (size_t col = 0; col < in.xSize(); ++col)
+        {
+            if (!in.valid(col, row))
+                continue;
+
+            neighbours.clear();
+            for (int dy = -radius; dy <= radius; ++dy)
+                for (int dx = -radius; dx <= radius; ++dx)
+                {
+                    long x = (long)col + dx;
+                    long y = (long)row + dy;
+                    if ((dx || dy) && x >= 0 && y >= 0 &&
+                            x < (long)in.xSize() && y < (long)in.ySize() &&
+                            in.valid(x, y))
+                        neighbours.push_back(in.displacement(x, y));
+                }
+            if ((int)neighbours.size() < minNeighbours)
+                continue;
+
+            Eigen::Vector3d vec = in.displacement(col, row);
+            Eigen::Vector3d med;
+            bool outlier = false;
+            for (int d = 0; d < 3; ++d)
+            {
+                values.clear();
+                for (const Eigen::Vector3d& n : neighbours)
+                    values.push_back(n(d));
+                med(d) = median(values);
+
+                for (double& v : values)
+                    v = std::abs(v - med(d));
+                double spread = median(values);
+                if (std::abs(vec(d) - med(d)) >
+                        opts.threshold * (spread + opts.noise))
+                    outlier = true;
+            }
+            if (outlier)
+            {
+                out.set(col, row, med,
+                    in.flags(col, row) | CellFlag::Regularized);
+                replaced++;
+            }
+        }
+    return replaced;
+}
+
+} // namespace AtlasProcessor
@@ -0,0 +1,16 @@
+#pragma once
+
+#include "DisplacementGrid.hpp"
+#include "Types.hpp"
+
+namespace AtlasProcessor
+{
+
+// Apply the outlier test of 'opts' to the registered cells in rows
+// [begin, end) of 'in', writing replacements into the same cells of 'out'.
+// Neighbours are always read from 'in', so disjoint row ranges can be
+// processed concurrently. Returns the number of cells replaced.
+size_t regularizeRows(const DisplacementGrid& in, DisplacementGrid& out,
+    size_t begin, size_t end, const RegularizeOptions& opts);
+
+} // namespace AtlasProcessor
@@ -0,0 +1,349 @@
+#include "RigidBatch.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include <cpd/gauss_transform.hpp>
+#include <cpd/transform.hpp>
+
+#include "GaussTransform.hpp"
+
+namespace AtlasProcessor
+{
+
+namespace
+{
+
+// Matrix of points, column-major, in scalar type T.
+template <typename T>
+using Points = Eigen::Matrix<T, Eigen::Dynamic, 3>;
+template <typename T>
+using Values = Eigen::Matrix<T, Eigen::Dynamic, 1>;
+
+} // unnamed namespace
+
+RigidBatch::RigidBatch(const RegistrationOptions& opts) : m_opts(opts),
+    m_outliers(cpd::DEFAULT_OUTLIERS), m_ws(Workspace::local())
+{
+    if (m_opts.precision == RegistrationOptions::Float)
+        buffer<float>(Workspace::Coords).clear();
+    else
+        buffer<double>(Workspace::Coords).clear();
+}
+
+
+RigidBatch::~RigidBatch()
+{
+    m_ws.update(m_problems.size());
+}
+
+
+size_t RigidBatch::add(const PointList& fixedPts, const PointList& movingPts,
+    const Result *start)
+{
+    Problem p;
+    p.n = fixedPts.size();
+    p.m = movingPts.size();
+
+    // Normalize as cpd does: center each set on its mean and scale both
+    // by the larger of their RMS distances from the mean.
+    p.fixedMean.setZero();
+    for (const Eigen::Vector3d& v : fixedPts)
+        p.fixedMean += v;
+    p.fixedMean /= (double)p.n;
+    p.movingMean.setZero();
+    for (const Eigen::Vector3d& v : movingPts)
+        p.movingMean += v;
+    p.movingMean /= (double)p.m;
+
+    double fixedSq = 0;
+    for (const Eigen::Vector3d& v : fixedPts)
+        fixedSq += (v - p.fixedMean).squaredNorm();
+    double movingSq = 0;
+    for (const Eigen::Vector3d& v : movingPts)
+        movingSq += (v - p.movingMean).squaredNorm();
+    p.scale = (std::max)(std::sqrt(fixedSq / p.n), std::sqrt(movingSq / p.m));
+
+    if (m_opts.precision == RegistrationOptions::Float)
+        store<float>(p, fixedPts, movingPts);
+    else
+        store<double>(p, fixedPts, movingPts);
+
+    // Express the starting transform in normalized coordinates: with
+    // fixed = R * moving + t, fixed' = R * moving' + (R * movingMean + t -
+    // fixedMean) / scale.
+    p.warm = (start != nullptr);
+    if (p.warm)
+    {
+        p.startRotation = start->transform.topLeftCorner<3, 3>();
+        p.startTranslation = (p.startRotation * p.movingMean +
+            start->transform.topRightCorner<3, 1>() - p.fixedMean) / p.scale;
+        p.startSigma2 = start->sigma2 / (p.scale * p.scale);
+    }
+
+    m_problems.push_back(p);
+    return m_problems.size() - 1;
+}
+
+
+// Normalize in double, relative to the means, then round to T.
+template <typename T>
+void RigidBatch::store(Problem& p, const PointList& fixedPts,
+    const PointList& movingPts)
+{
+    std::vector<T>& coords = buffer<T>(Workspace::Coords);
+    p.offset = coords.size();
+    coords.resize(coords.size() + 3 * p.n + 6 * p.m);
+
+    T *f = fixed<T>(p);
+    for (size_t i = 0; i < p.n; ++i)
+        for (size_t d = 0; d < 3; ++d)
+            f[d * p.n + i] = T((fixedPts[i](d) - p.fixedMean(d)) / p.scale);
+    T *mv = moving<T>(p);
+    for (size_t i = 0; i < p.m; ++i)
+        for (size_t d = 0; d < 3; ++d)
+            mv[d * p.m + i] = T((movingPts[i](d) - p.movingMean(d)) / p.scale);
+}
+
+
+template <typename T>
+void RigidBatch::init(Problem& p)
+{
+    using namespace Eigen;
+
+    Map<const Points<T>> x(fixed<T>(p), p.n, 3);
+    Map<const Points<T>> y(moving<T>(p), p.m, 3);
+    Map<Points<T>> pts(points<T>(p), p.m, 3);
+
+    if (p.warm)
+    {
+        p.rotation = p.startRotation;
+        p.translation = p.startTranslation;
+        pts.noalias() = y * p.rotation.cast<T>().transpose();
+        pts.rowwise() += p.translation.cast<T>().transpose();
+    }
+    else
+    {
+        p.rotation.setIdentity();
+        p.translation.setZero();
+        pts = y;
+    }
+
+    // A starting sigma2 of zero (e.g. an exact ICP fit) would stall EM.
+    if (p.warm && p.startSigma2 > 0)
+        p.sigma2 = p.startSigma2;
+    else
+        // cpd::default_sigma2() of the starting points.
+        p.sigma2 = (p.m * x.template cast<double>().squaredNorm() +
+            p.n * pts.template cast<double>().squaredNorm() -
+            2 * x.template cast<double>().colwise().sum().dot(
+                pts.template cast<double>().colwise().sum())) /
+            (p.n * p.m * 3);
+    p.l = 0;
+    p.iterations = 0;
+    p.active = (m_opts.maxIterations > 0 &&
+        p.sigma2 > 10 * std::numeric_limits<double>::epsilon());
+    p.flags = 0;
+    p.valid = true;
+    p.elapsed = Clock::duration::zero();
+    p.bestL = (std::numeric_limits<double>::max)();
+}
+
+
+// Compute the E-step into the workspace buffers and return the negative
+// log-likelihood.
+template <typename T>
+double RigidBatch::expectation(Problem& p)
+{
+    using namespace Eigen;
+
+    std::vector<T>& p1 = buffer<T>(Workspace::P1);
+    std::vector<T>& pt1 = buffer<T>(Workspace::Pt1);
+    std::vector<T>& px = buffer<T>(Workspace::Px);
+    if (p.n * p.m <= m_opts.directLimit)
+        return gaussAffinity(fixed<T>(p), p.n, points<T>(p), p.m, p.sigma2,
+            m_outliers, p1.data(), pt1.data(), px.data(),
+            buffer<T>(Workspace::Work).data());
+
+    // The fast Gauss transform needs its own (double) matrices, but its
+    // cost dwarfs that of the copies.
+    if (!m_fgt)
+        m_fgt = cpd::GaussTransform::make_default();
+    cpd::Matrix x = Map<const Points<T>>(fixed<T>(p), p.n, 3).
+        template cast<double>();
+    cpd::Matrix y = Map<const Points<T>>(points<T>(p), p.m, 3).
+        template cast<double>();
+    cpd::Probabilities probs = m_fgt->compute(x, y, p.sigma2, m_outliers);
+    Map<Values<T>>(p1.data(), p.m) = probs.p1.cast<T>();
+    Map<Values<T>>(pt1.data(), p.n) = probs.pt1.cast<T>();
+    Map<Points<T>>(px.data(), p.m, 3) = probs.px.cast<T>();
+    return probs.l;
+}
+
+
+// One EM iteration. This is the loop body of cpd::Transform::run() and
+// cpd::Rigid::compute_one(), followed by the stopping tests.
+template <typename T>
+void RigidBatch::iterate(Problem& p)
+{
+    using namespace Eigen;
+
+    Clock::time_point start = Clock::now();
+
+    Map<const Points<T>> x(fixed<T>(p), p.n, 3);
+    Map<const Points<T>> y(moving<T>(p), p.m, 3);
+    Map<Points<T>> pts(points<T>(p), p.m, 3);
+    Map<const Values<T>> p1(buffer<T>(Workspace::P1).data(), p.m);
+    Map<const Values<T>> pt1(buffer<T>(Workspace::Pt1).data(), p.n);
+    Map<const Points<T>> px(buffer<T>(Workspace::Px).data(), p.m, 3);
+
+    // 'l' measures the current transform.
+    double l = expectation<T>(p);
+    double ntol = std::abs((l - p.l) / l);
+    p.l = l;
+    if (l < p.bestL)
+    {
+        p.bestL = l;
+        p.bestRotation = p.rotation;
+        p.bestTranslation = p.translation;
+    }
+
+    // The sums are taken a column at a time, which casts to double as it
+    // goes rather than into temporaries.
+    auto p1d = p1.template cast<double>();
+    auto pt1d = pt1.template cast<double>();
+    double np = pt1d.sum();
+    Vector3d muX;
+    Vector3d muY;
+    Matrix3d a;
+    double xx = 0;
+    double yy = 0;
+    for (int c = 0; c < 3; ++c)
+    {
+        auto xc = x.col(c).template cast<double>();
+        auto yc = y.col(c).template cast<double>();
+        muX(c) = xc.dot(pt1d) / np;
+        muY(c) = yc.dot(p1d) / np;
+        xx += xc.cwiseAbs2().dot(pt1d);
+        yy += yc.cwiseAbs2().dot(p1d);
+        for (int r = 0; r < 3; ++r)
+            a(r, c) = px.col(r).template cast<double>().dot(yc);
+    }
+    a -= np * muX * muY.transpose();
+    JacobiSVD<Matrix3d> svd(a, ComputeFullU | ComputeFullV);
+    Matrix3d c = Matrix3d::Identity();
+    c(2, 2) = (svd.matrixU() * svd.matrixV().transpose()).determinant();
+    Matrix3d rotation = svd.matrixU() * c * svd.matrixV().transpose();
+    Vector3d translation = muX - rotation * muY;
+    double trace = (svd.singularValues().asDiagonal() * c).trace();
+    double sigma2 = std::abs((xx + yy - np * muX.dot(muX) -
+        np * muY.dot(muY) - 2 * trace) / (np * 3));
+
+    // The normalized points have an RMS distance of at most one from their
+    // center, so this approximates how far a point moved, in scene units.
+    double moved = p.scale * ((rotation - p.rotation).norm() +
+        (translation - p.translation).norm());
+    double sigma2Change = std::abs(sigma2 - p.sigma2) / p.sigma2;
+
+    p.rotation = rotation;
+    p.translation = translation;
+    p.sigma2 = sigma2;
+    pts.noalias() = y * p.rotation.cast<T>().transpose();
+    pts.rowwise() += p.translation.cast<T>().transpose();
+    p.iterations++;
+    p.elapsed += Clock::now() - start;
+
+    p.active = (ntol > m_opts.tolerance &&
+        p.sigma2 > 10 * std::numeric_limits<double>::epsilon());
+    if (m_opts.sigma2Tolerance > 0 && sigma2Change <= m_opts.sigma2Tolerance)
+        p.active = false;
+    if (m_opts.transformTolerance > 0 && moved <= m_opts.transformTolerance)
+        p.active = false;
+    if (p.active && p.iterations >= m_opts.maxIterations)
+    {
+        p.active = false;
+        p.flags |= CellFlag::IterationLimit;
+    }
+    if (p.active && m_opts.timeBudget > 0 &&
+        std::chrono::duration<double>(p.elapsed).count() >= m_opts.timeBudget)
+    {
+        p.active = false;
+        p.flags |= CellFlag::TimeLimit;
+        // EM shouldn't make things worse, but the fast Gauss transform is
+        // approximate, so fall back to the best transform measured if the
+        // last one measured was worse.
+        if (m_opts.anytime && p.l > p.bestL)
+        {
+            p.rotation = p.bestRotation;
+            p.translation = p.bestTranslation;
+        }
+        p.valid = m_opts.anytime;
+    }
+}
+
+
+void RigidBatch::run()
+{
+    if (m_opts.precision == RegistrationOptions::Float)
+        runAll<float>();
+    else
+        runAll<double>();
+}
+
+
+template <typename T>
+void RigidBatch::runAll()
+{
+    size_t maxN = 0;
+    size_t maxM = 0;
+    for (Problem& p : m_problems)
+    {
+        maxN = (std::max)(maxN, p.n);
+        maxM = (std::max)(maxM, p.m);
+        init<T>(p);
+    }
+    std::vector<T>& pt1 = buffer<T>(Workspace::Pt1);
+    if (pt1.size() < maxN)
+        pt1.resize(maxN);
+    std::vector<T>& p1 = buffer<T>(Workspace::P1);
+    if (p1.size() < maxM)
+    {
+        p1.resize(maxM);
+        buffer<T>(Workspace::Px).resize(3 * maxM);
+        buffer<T>(Workspace::Work).resize(maxM);
+    }
+
+    bool active = true;
+    while (active)
+    {
+        active = false;
+        for (Problem& p : m_problems)
+            if (p.active)
+            {
+                iterate<T>(p);
+                active |= p.active;
+            }
+    }
+}
+
+
+RigidBatch::Result RigidBatch::result(size_t i) const
+{
+    const Problem& p = m_problems[i];
+
+    Result r;
+    // Undo the normalization (cpd::RigidResult::denormalize()). The scale
+    // is shared by both sets, so the rotation is unaffected.
+    r.transform.setIdentity();
+    r.transform.topLeftCorner<3, 3>() = p.rotation;
+    r.transform.topRightCorner<3, 1>() = p.scale * p.translation +
+        p.fixedMean - p.rotation * p.movingMean;
+    r.sigma2 = p.sigma2 * p.scale * p.scale;
+    r.iterations = p.iterations;
+    r.flags = p.flags;
+    r.valid = p.valid;
+    return r;
+}
+
+} // namespace AtlasProcessor
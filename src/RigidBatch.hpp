@@ -0,0 +1,137 @@
+#pragma once
+
+#include <chrono>
+#include <memory>
+#include <vector>
+
+#include <Eigen/Dense>
+
+#include "Types.hpp"
+#include "Workspace.hpp"
+
+namespace cpd
+{
+class GaussTransform;
+}
+
+namespace AtlasProcessor
+{
+
+// Rigid CPD registration of one or more point sets.
+//
+// This follows cpd::Rigid (normalized input, no scaling, no reflections),
+// but the EM iterations of all problems in the batch are run together,
+// round-robin, in the calling thread's Workspace, which is reused from one
+// batch to the next. The M-step works on fixed-size 3x3 matrices, so an
+// iteration of a small problem does no heap allocation at all. Problems
+// too large for the direct Gauss transform use cpd's fast Gauss transform.
+//
+// Coordinates are stored and the E-step computed in the scalar type chosen
+// by RegistrationOptions::precision. Normalized coordinates are centered on
+// each set's mean, so single precision holds whatever the scene's origin,
+// halving the memory traffic and doubling the SIMD width of the E-step. The
+// sums of the M-step are accumulated in double either way.
+//
+// Each problem stops when any of the criteria in RegistrationOptions is
+// met.
+class RigidBatch
+{
+public:
+    struct Result
+    {
+        // Transform that maps the moving points onto the fixed points, as
+        // cpd::RigidResult::matrix().
+        Eigen::Matrix4d transform;
+        double sigma2;
+        size_t iterations;
+        unsigned flags;     // CellFlag values.
+        bool valid;         // False if the result was discarded.
+    };
+
+    RigidBatch(const RegistrationOptions& opts);
+    ~RigidBatch();
+
+    // Add a problem that moves 'moving' onto 'fixed'. If 'start' is given,
+    // registration starts from its transform and sigma2 (e.g. those of a
+    // similar problem) rather than from scratch. Returns the problem's
+    // index.
+    size_t add(const PointList& fixed, const PointList& moving,
+        const Result *start = nullptr);
+
+    // Run all problems until they stop.
+    void run();
+
+    Result result(size_t i) const;
+
+    size_t size() const
+        { return m_problems.size(); }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Problem
+    {
+        size_t n;           // Number of fixed points.
+        size_t m;           // Number of moving points.
+        size_t offset;      // Offset of normalized coordinates in m_coords.
+        Eigen::Vector3d fixedMean;
+        Eigen::Vector3d movingMean;
+        double scale;
+        Eigen::Matrix3d rotation;
+        Eigen::Vector3d translation;
+        double sigma2;
+        double l;
+        size_t iterations;
+        bool active;
+        unsigned flags;
+        bool valid;
+        Clock::duration elapsed;
+        // Transform with the lowest negative log-likelihood seen so far.
+        double bestL;
+        Eigen::Matrix3d bestRotation;
+        Eigen::Vector3d bestTranslation;
+        // Warm start, normalized.
+        bool warm;
+        Eigen::Matrix3d startRotation;
+        Eigen::Vector3d startTranslation;
+        double startSigma2;
+    };
+
+    // Each is instantiated for float and double.
+    template <typename T>
+    void store(Problem& p, const PointList& fixedPts,
+        const PointList& movingPts);
+    template <typename T>
+    void init(Problem& p);
+    template <typename T>
+    void iterate(Problem& p);
+    template <typename T>
+    double expectation(Problem& p);
+    template <typename T>
+    void runAll();
+
+    template <typename T>
+    std::vector<T>& buffer(Workspace::Buffer b)
+        { return m_ws.buffer<T>(b); }
+    template <typename T>
+    T *fixed(const Problem& p)
+        { return buffer<T>(Workspace::Coords).data() + p.offset; }
+    template <typename T>
+    T *moving(const Problem& p)
+        { return fixed<T>(p) + 3 * p.n; }
+    template <typename T>
+    T *points(const Problem& p)
+        { return moving<T>(p) + 3 * p.m; }
+
+    RegistrationOptions m_opts;
+    double m_outliers;
+    std::unique_ptr<cpd::GaussTransform> m_fgt;
+
+    std::vector<Problem> m_problems;
+    // Workspace buffers: the column-major fixed (N x 3), moving (M x 3) and
+    // transformed moving (M x 3) coordinates of each problem, and E-step
+    // buffers sized for the largest problem.
+    Workspace& m_ws;
+};
+
+} // namespace AtlasProcessor
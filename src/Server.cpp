@@ -0,0 +1,224 @@
+#include "Server.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <fstream>
+#include <thread>
+
+#include <pdal/private/gdal/GDALUtils.hpp>
+#include <pdal/util/FileUtils.hpp>
+#include <pdal/util/Utils.hpp>
+
+namespace AtlasProcessor
+{
+
+void fatal(const std::string& err);
+
+namespace
+{
+
+volatile std::sig_atomic_t terminated = 0;
+
+void onSignal(int)
+{
+    terminated = 1;
+}
+
+const std::string JobExt(".job");
+
+} // unnamed namespace
+
+Server::Server() : m_running(0), m_done(0), m_failed(0)
+{}
+
+
+void Server::addArgs()
+{
+    m_args.add("spool", "Spool directory", m_spool).setPositional();
+    m_args.add("max_jobs", "Maximum number of jobs to run at once",
+        m_maxJobs, 2);
+    m_args.add("threads", "Number of threads used for registration, "
+        "shared by all jobs", m_threads,
+        (int)std::thread::hardware_concurrency());
+    m_args.add("poll", "Milliseconds between checks for new jobs", m_poll,
+        500);
+}
+
+
+void Server::run(const StringList& s)
+{
+    addArgs();
+    try
+    {
+        m_args.parse(s);
+    }
+    catch (const pdal::arg_error& err)
+    {
+        fatal(err.what());
+    }
+    if (m_maxJobs < 1)
+        fatal("'max_jobs' must be at least 1.");
+
+    for (std::string dir : { "incoming", "running", "done", "failed" })
+        if (!pdal::FileUtils::createDirectories(path(dir, "")))
+            fatal("Unable to create spool directory '" + path(dir, "") +
+                "'.");
+
+    std::signal(SIGTERM, onSignal);
+    std::signal(SIGINT, onSignal);
+
+    // Done once here rather than by every job.
+    pdal::gdal::registerDrivers();
+
+    size_t threads = (std::max)(m_threads, 1);
+    m_regPool.reset(new pdal::ThreadPool(threads, threads * 4, false));
+    m_jobPool.reset(new pdal::ThreadPool(m_maxJobs, m_maxJobs, false));
+
+    serve();
+}
+
+
+void Server::serve()
+{
+    std::cerr << "atlas: serving '" << m_spool << "' with " << m_maxJobs <<
+        " job slots and " << m_regPool->numThreads() <<
+        " registration threads.\n";
+
+    while (!stopRequested())
+    {
+        writeStatus(claim());
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_jobDone.wait_for(lock, std::chrono::milliseconds(m_poll));
+    }
+
+    std::cerr << "atlas: stopping once the running jobs finish.\n";
+    m_jobPool->join();
+    m_regPool->join();
+    writeStatus(incoming().size());
+    pdal::FileUtils::deleteFile(path("stop", ""));
+    std::cerr << "atlas: " << m_done << " jobs done, " << m_failed <<
+        " failed.\n";
+}
+
+
+// Claim as many waiting jobs as there are free slots. Returns the number of
+// jobs left waiting.
+size_t Server::claim()
+{
+    std::vector<std::string> jobs = incoming();
+
+    size_t claimed = 0;
+    for (const std::string& name : jobs)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_running >= (size_t)m_maxJobs)
+                break;
+        }
+
+        // Another server may have claimed the job first.
+        if (std::rename(path("incoming", name).c_str(),
+                path("running", name).c_str()) != 0)
+            continue;
+        claimed++;
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_running++;
+        }
+        m_jobPool->add([this, name](){ runJob(name); });
+    }
+    return jobs.size() - claimed;
+}
+
+
+void Server::runJob(const std::string& name)
+{
+    std::string error;
+    try
+    {
+        std::string text =
+            pdal::FileUtils::readFileIntoString(path("running", name));
+        StringList args = pdal::Utils::split2(text,
+            [](char c){ return std::isspace((unsigned char)c); });
+
+        Atlas atlas(m_regPool.get());
+        atlas.execute(args);
+    }
+    catch (const std::exception& err)
+    {
+        error = err.what();
+    }
+
+    if (error.empty())
+        std::rename(path("running", name).c_str(), path("done", name).c_str());
+    else
+    {
+        std::cerr << "atlas: job '" << name << "' failed: " << error << "\n";
+        std::ofstream out(path("failed", name + ".err"));
+        out << error << "\n";
+        out.close();
+        std::rename(path("running", name).c_str(),
+            path("failed", name).c_str());
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_running--;
+    if (error.empty())
+        m_done++;
+    else
+        m_failed++;
+    m_jobDone.notify_all();
+}
+
+
+// Replace the status file in one step so that readers never see it
+// partially written.
+void Server::writeStatus(size_t queued)
+{
+    std::string tmp = path("status.tmp", "");
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        std::ofstream out(tmp);
+        out << "running " << m_running << "\n" <<
+            "queued " << queued << "\n" <<
+            "done " << m_done << "\n" <<
+            "failed " << m_failed << "\n";
+    }
+    std::rename(tmp.c_str(), path("status", "").c_str());
+}
+
+
+std::string Server::path(const std::string& dir, const std::string& name) const
+{
+    std::string p = m_spool + "/" + dir;
+    if (name.size())
+        p += "/" + name;
+    return p;
+}
+
+
+// Names of the jobs waiting in incoming/, oldest name first.
+std::vector<std::string> Server::incoming() const
+{
+    std::vector<std::string> jobs;
+    for (const std::string& f : pdal::FileUtils::directoryList(path("incoming", "")))
+    {
+        std::string name = pdal::FileUtils::getFilename(f);
+        if (pdal::FileUtils::extension(name) == JobExt)
+            jobs.push_back(name);
+    }
+    std::sort(jobs.begin(), jobs.end());
+    return jobs;
+}
+
+
+bool Server::stopRequested() const
+{
+    return terminated || pdal::FileUtils::fileExists(path("stop", ""));
+}
+
+} // namespace AtlasProcessor
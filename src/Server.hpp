@@ -0,0 +1,66 @@
+#pragma once
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+
+#include <pdal/util/ProgramArgs.hpp>
+#include <pdal/util/ThreadPool.hpp>
+
+#include "Atlas.hpp"
+
+namespace AtlasProcessor
+{
+
+// Long-running mode that takes jobs from a spool directory and runs them
+// in-process, so that GDAL drivers, PDAL plugins and the registration
+// workers stay loaded from one job to the next.
+//
+// The spool directory holds:
+//   incoming/   Job files ("*.job") waiting to be run. Each holds the
+//               arguments of a single atlas-cpd run, separated by white
+//               space. Write a job elsewhere and rename it into place.
+//   running/    Jobs being run.
+//   done/       Jobs that succeeded.
+//   failed/     Jobs that failed, each with a "<job>.err" holding the error.
+//   status      Number of jobs running and queued, rewritten on each poll.
+//   stop        Create this file (or send SIGTERM) to stop once the running
+//               jobs have finished.
+//
+// Jobs are claimed by renaming them into running/, so several servers can
+// share a spool directory. No more than 'max_jobs' jobs run at once; the
+// rest stay in incoming/ until a slot is free. All jobs share a single pool
+// of registration threads.
+class Server
+{
+public:
+    Server();
+
+    void run(const StringList& s);
+
+private:
+    void addArgs();
+    void serve();
+    size_t claim();
+    void runJob(const std::string& name);
+    void writeStatus(size_t queued);
+    std::string path(const std::string& dir, const std::string& name) const;
+    std::vector<std::string> incoming() const;
+    bool stopRequested() const;
+
+    pdal::ProgramArgs m_args;
+    std::string m_spool;
+    int m_maxJobs;
+    int m_threads;
+    int m_poll;
+
+    std::unique_ptr<pdal::ThreadPool> m_jobPool;
+    std::unique_ptr<pdal::ThreadPool> m_regPool;
+    std::mutex m_mutex;
+    std::condition_variable m_jobDone;
+    size_t m_running;
+    size_t m_done;
+    size_t m_failed;
+};
+
+} // namespace AtlasProcessor
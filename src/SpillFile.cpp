@@ -0,0 +1,82 @@
+#include "SpillFile.hpp"
+
+#include <vector>
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <pdal/PointView.hpp>
+
+namespace AtlasProcessor
+{
+
+SpillFile::SpillFile(const std::string& dir) : m_file(nullptr), m_size(0)
+{
+    if (dir.empty())
+        m_file = std::tmpfile();
+    else
+    {
+        // Unlinked at once, so the space is freed however we exit.
+        std::string path = dir + "/atlas-spill-XXXXXX";
+        int fd = mkstemp(&path[0]);
+        if (fd >= 0)
+        {
+            unlink(path.c_str());
+            m_file = fdopen(fd, "w+b");
+            if (!m_file)
+                close(fd);
+        }
+    }
+    if (!m_file)
+        throw pdal::pdal_error("Unable to create a spill file in '" +
+            (dir.empty() ? std::string("the temporary directory") : dir) +
+            "'.");
+}
+
+
+SpillFile::~SpillFile()
+{
+    std::fclose(m_file);
+}
+
+
+SpillFile::Extent SpillFile::write(const PointList& points)
+{
+    Eigen::Vector3d origin = points.size() ? points.front() :
+        Eigen::Vector3d::Zero();
+    std::vector<float> buf(3 * points.size());
+    for (size_t i = 0; i < points.size(); ++i)
+        for (int d = 0; d < 3; ++d)
+            buf[3 * i + d] = (float)(points[i](d) - origin(d));
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Extent e { m_size, points.size(), origin };
+    if (fseeko(m_file, (off_t)m_size, SEEK_SET) != 0 ||
+            std::fwrite(buf.data(), sizeof(float), buf.size(), m_file) !=
+            buf.size())
+        throw pdal::pdal_error("Unable to write to the spill file. Is the "
+            "disk full?");
+    m_size += buf.size() * sizeof(float);
+    return e;
+}
+
+
+void SpillFile::read(const Extent& extent, PointList& out)
+{
+    const Eigen::Vector3d& origin = extent.origin;
+    std::vector<float> buf(3 * extent.count);
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (fseeko(m_file, (off_t)extent.offset, SEEK_SET) != 0 ||
+                std::fread(buf.data(), sizeof(float), buf.size(), m_file) !=
+                buf.size())
+            throw pdal::pdal_error("Unable to read from the spill file.");
+    }
+
+    out.reserve(out.size() + extent.count);
+    for (size_t i = 0; i < extent.count; ++i)
+        out.emplace_back(buf[3 * i] + origin(0), buf[3 * i + 1] + origin(1),
+            buf[3 * i + 2] + origin(2));
+}
+
+} // namespace AtlasProcessor
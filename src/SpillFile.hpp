@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+
+#include "Types.hpp"
+
+namespace AtlasProcessor
+{
+
+// Temporary file that holds points while they're out of memory. Points are
+// stored as float offsets from the first point written with them, 12 bytes
+// a point rather than 24. For the points of a cell that keeps them to
+// within about 1e-7 of the cell's size. The file is removed when closed.
+//
+// write() and read() may be called from any thread.
+class SpillFile
+{
+public:
+    // A run of points written by one call to write().
+    struct Extent
+    {
+        uint64_t offset;
+        size_t count;
+        Eigen::Vector3d origin;
+    };
+
+    // Create the file in 'dir', or in the system's temporary directory if
+    // empty. Throws pdal::pdal_error on failure.
+    SpillFile(const std::string& dir = std::string());
+    ~SpillFile();
+
+    Extent write(const PointList& points);
+    // Append the points of 'extent' to 'out'.
+    void read(const Extent& extent, PointList& out);
+
+    // Bytes written.
+    uint64_t size() const
+        { return m_size; }
+
+private:
+    std::FILE *m_file;
+    std::mutex m_mutex;
+    uint64_t m_size;
+};
+
+} // namespace AtlasProcessor
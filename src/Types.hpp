@@ -1,5 +1,12 @@
 #pragma once
 
+#include <bitset>
+#include <cstddef>
+#include <limits>
+#include <vector>
+
+#include <Eigen/Dense>
+
 namespace AtlasProcessor
 {
 
@@ -9,6 +16,174 @@ enum class Order
     After
 };
 
+using PointList = std::vector<Eigen::Vector3d>;
+
+// Conditions noted while registering a cell.
+namespace CellFlag
+{
+enum : unsigned
+{
+    IterationLimit = 1,     // Stopped at the iteration limit.
+    TimeLimit = 2,          // Stopped at the time budget.
+    Regularized = 4,        // Replaced by the median of its neighbours.
+    Icp = 8,                // Registered by ICP rather than CPD.
+    IcpRejected = 16,       // Registered by CPD after ICP's result was
+                            // rejected (hybrid engine).
+    Split = 32,             // Registered as quadrants (adaptive cells).
+    Merged = 64             // Registered with its neighbours as a block
+                            // (adaptive cells).
+};
+}
+
+// Selects the points that are inserted into the grid. By default every
+// point is kept.
+struct PointFilter
+{
+    enum Returns
+    {
+        AllReturns,
+        FirstReturn,
+        LastReturn,
+        OnlyReturn      // Points that are their pulse's only return.
+    };
+
+    PointFilter() : allClasses(true), returns(AllReturns),
+        intensityMin((std::numeric_limits<double>::lowest)()),
+        intensityMax((std::numeric_limits<double>::max)())
+    {}
+
+    bool usesClass() const
+        { return !allClasses; }
+    bool usesReturns() const
+        { return returns != AllReturns; }
+    bool usesIntensity() const
+        { return intensityMin != (std::numeric_limits<double>::lowest)() ||
+            intensityMax != (std::numeric_limits<double>::max)(); }
+    bool active() const
+        { return usesClass() || usesReturns() || usesIntensity(); }
+
+    bool keep(int cls, int ret, int numRets, double intensity) const
+    {
+        if (!allClasses && (cls < 0 || cls >= (int)classes.size() ||
+                !classes[cls]))
+            return false;
+        if ((returns == FirstReturn && ret != 1) ||
+                (returns == LastReturn && ret != numRets) ||
+                (returns == OnlyReturn && numRets != 1))
+            return false;
+        return intensity >= intensityMin && intensity <= intensityMax;
+    }
+
+    // Classification values to keep, when not 'allClasses'.
+    std::bitset<256> classes;
+    bool allClasses;
+    Returns returns;
+    double intensityMin;
+    double intensityMax;
+};
+
+struct RegistrationOptions
+{
+    // Registration method (see Engine).
+    enum Engines
+    {
+        Cpd,
+        Icp,
+        Hybrid
+    };
+
+    // Scalar type of CPD's working coordinates (see RigidBatch).
+    enum Precision
+    {
+        Double,
+        Float
+    };
+
+    // The defaults are those of the command line.
+    RegistrationOptions() : minpts(250), debug(false), engine(Cpd),
+        precision(Double), directLimit(4000000), batchSize(32),
+        maxIterations(150), tolerance(1e-5), sigma2Tolerance(0),
+        transformTolerance(0), timeBudget(0), anytime(false),
+        icpIterations(30), icpTrim(0.9), icpMaxResidual(0.1), bootstrap(0),
+        bootstrapFraction(0.5), adaptiveLevels(0), maxPoints(20000)
+    {}
+
+    // Minimum number of points in each scene for a cell to be registered.
+    int minpts;
+    bool debug;
+    Engines engine;
+    Precision precision;
+    // Cells where (before points * after points) is no more than this use
+    // the direct Gauss transform rather than the fast Gauss transform.
+    size_t directLimit;
+    // Number of direct-transform cells registered together as a batch.
+    // Values below 2 register every cell on its own.
+    size_t batchSize;
+
+    // Stopping criteria. Registration stops when any is met. Zero disables
+    // all but the iteration limit.
+    size_t maxIterations;
+    // Relative change in the negative log-likelihood (as cpd).
+    double tolerance;
+    // Relative change in sigma2.
+    double sigma2Tolerance;
+    // Approximate largest movement of a point between iterations, in
+    // scene units.
+    double transformTolerance;
+    // Wall time per cell, in seconds.
+    double timeBudget;
+    // When the time budget runs out, keep the best transform found so far
+    // rather than discarding the cell.
+    bool anytime;
+
+    // ICP. Iterations also stop when the update moves points no more than
+    // 'transformTolerance', if set.
+    size_t icpIterations;
+    // Fraction of the closest point pairs used by each iteration.
+    double icpTrim;
+    // Largest RMS point-to-plane residual, in scene units, at which the
+    // hybrid engine accepts an ICP result.
+    double icpMaxResidual;
+
+    // Uncertainty (see bootstrap()). Number of resampled registrations per
+    // cell, zero for none.
+    size_t bootstrap;
+    // Fraction of each scene's points in each resample.
+    double bootstrapFraction;
+
+    // Adaptive cells. Cells with more than 'maxPoints' points in either
+    // scene are split into quadrants, and those into quadrants, until each
+    // is within the budget, and cells with fewer than 'minpts' are merged
+    // into blocks of neighbours until there are enough, by at most this
+    // many levels (no more than 16) either way. Zero keeps every cell as it
+    // is.
+    int adaptiveLevels;
+    size_t maxPoints;
+};
+
+// Outlier replacement in the displacement field, by the normalized median
+// test (Westerweel and Scarano, 2005). A cell is an outlier when, for any
+// component, its distance from the median of its neighbours exceeds
+// 'threshold' times (the median distance of the neighbours from that
+// median + 'noise'). Outliers are replaced by the median.
+struct RegularizeOptions
+{
+    RegularizeOptions() : enabled(false), radius(1), threshold(2.0),
+        noise(0.1), minNeighbours(3)
+    {}
+
+    bool enabled;
+    // Neighbours are the registered cells within this many cells.
+    int radius;
+    double threshold;
+    // Expected noise in the displacements, in scene units. Keeps uniform
+    // neighbourhoods from flagging tiny differences.
+    double noise;
+    // Cells with fewer registered neighbours (and those with none) are left
+    // alone.
+    int minNeighbours;
+};
+
 }
 
 namespace AP = AtlasProcessor;
@@ -0,0 +1,60 @@
+#include "Workspace.hpp"
+
+#include <algorithm>
+#include <mutex>
+
+namespace AtlasProcessor
+{
+
+namespace
+{
+
+// Statistics outlive their workspaces, which are destroyed along with the
+// threads that own them.
+std::mutex registryMutex;
+std::vector<std::shared_ptr<Workspace::Stats>> registry;
+
+} // unnamed namespace
+
+Workspace::Workspace() : m_stats(new Stats)
+{
+    std::lock_guard<std::mutex> lock(registryMutex);
+    registry.push_back(m_stats);
+}
+
+
+Workspace& Workspace::local()
+{
+    static thread_local Workspace ws;
+    return ws;
+}
+
+
+std::vector<Workspace::Stats> Workspace::allStats()
+{
+    std::vector<Stats> stats;
+
+    std::lock_guard<std::mutex> lock(registryMutex);
+    for (auto& s : registry)
+        stats.push_back(*s);
+    return stats;
+}
+
+
+void Workspace::update(size_t cells)
+{
+    size_t bytes = 0;
+    for (const std::vector<double>& b : m_buffers)
+        bytes += b.capacity() * sizeof(double);
+    for (const std::vector<float>& b : m_floatBuffers)
+        bytes += b.capacity() * sizeof(float);
+
+    std::lock_guard<std::mutex> lock(registryMutex);
+    if (bytes > m_stats->bytes)
+        m_stats->grows++;
+    m_stats->bytes = bytes;
+    m_stats->highWater = (std::max)(m_stats->highWater, bytes);
+    m_stats->cells += cells;
+}
+
+} // namespace AtlasProcessor
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+
+namespace AtlasProcessor
+{
+
+// Scratch memory for registration, one per worker thread. Buffers are
+// never shrunk, so each ends up sized for the largest cell its thread has
+// seen and is then reused for every cell that follows, without touching
+// the allocator.
+class Workspace
+{
+public:
+    enum Buffer
+    {
+        Coords,     // Point coordinates.
+        P1,         // E-step output, one value per moving point.
+        Pt1,        // E-step output, one value per fixed point.
+        Px,         // E-step output, three values per moving point.
+        Work,       // E-step scratch, one value per moving point.
+        NumBuffers
+    };
+
+    struct Stats
+    {
+        Stats() : bytes(0), highWater(0), grows(0), cells(0)
+        {}
+
+        size_t bytes;       // Memory currently held.
+        size_t highWater;   // Most memory ever held.
+        size_t grows;       // Number of updates that found the memory grown.
+        size_t cells;       // Number of cells registered.
+    };
+
+    // The calling thread's workspace.
+    static Workspace& local();
+
+    // Statistics for every workspace created so far.
+    static std::vector<Stats> allStats();
+
+    // Buffer 'b' of values of type T, float or double, each of which has
+    // its own set of buffers. Callers may resize it but shouldn't shrink
+    // its capacity.
+    template <typename T>
+    std::vector<T>& buffer(Buffer b);
+
+    // Record that 'cells' cells were registered with this workspace and
+    // bring the memory statistics up to date.
+    void update(size_t cells);
+
+private:
+    Workspace();
+
+    std::vector<double> m_buffers[NumBuffers];
+    std::vector<float> m_floatBuffers[NumBuffers];
+    std::shared_ptr<Stats> m_stats;
+};
+
+template <>
+inline std::vector<double>& Workspace::buffer<double>(Buffer b)
+    { return m_buffers[b]; }
+
+template <>
+inline std::vector<float>& Workspace::buffer<float>(Buffer b)
+    { return m_floatBuffers[b]; }
+
+} // namespace AtlasProcessor
@@ -0,0 +1,136 @@
+// Checks the Gauss transform kernel selected for this CPU (or forced with
+// ATLAS_SIMD) against the scalar reference, in double and single
+// precision, and against cpd::GaussTransformDirect, which it replaces, in
+// double precision, to the tolerances stated in GaussTransform.hpp. Sizes
+// aren't multiples of the vector widths, so the tails are exercised. Exits
+// with status 1 if any result is out of tolerance.
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include <cpd/gauss_transform.hpp>
+
+#include "src/GaussTransform.hpp"
+
+namespace
+{
+
+using namespace AtlasProcessor;
+
+// Largest difference between 'a' and 'b' relative to the largest value
+// of 'b', since kernels may flush tiny values to zero.
+template <typename T>
+double error(const std::vector<T>& a, const std::vector<T>& b)
+{
+    double diff = 0;
+    double scale = 0;
+    for (size_t i = 0; i < a.size(); ++i)
+    {
+        diff = (std::max)(diff, std::abs((double)a[i] - (double)b[i]));
+        scale = (std::max)(scale, std::abs((double)b[i]));
+    }
+    return scale > 0 ? diff / scale : diff;
+}
+
+
+// Run the kernel and the reference on random points and return the
+// largest relative error of any output.
+template <typename T>
+double check(size_t n, size_t m, double sigma2, std::mt19937& gen)
+{
+    std::uniform_real_distribution<double> coord(-1, 1);
+    std::vector<T> fixed(3 * n);
+    std::vector<T> moving(3 * m);
+    for (T& v : fixed)
+        v = (T)coord(gen);
+    for (T& v : moving)
+        v = (T)coord(gen);
+
+    const double outliers = 0.1;
+    std::vector<T> p1(m), pt1(n), px(3 * m), work(m);
+    std::vector<T> refP1(m), refPt1(n), refPx(3 * m);
+    double l = gaussAffinity(fixed.data(), n, moving.data(), m, sigma2,
+        outliers, p1.data(), pt1.data(), px.data(), work.data());
+    double refL = gaussAffinityReference(fixed.data(), n, moving.data(), m,
+        sigma2, outliers, refP1.data(), refPt1.data(), refPx.data(),
+        work.data());
+
+    double err = std::abs(l - refL) / (std::max)(std::abs(refL), 1.0);
+    err = (std::max)(err, error(p1, refP1));
+    err = (std::max)(err, error(pt1, refPt1));
+    err = (std::max)(err, error(px, refPx));
+    return err;
+}
+
+
+// As check(), against cpd::GaussTransformDirect. Its matrices hold a point
+// per row and are column-major, as the kernel's arrays are.
+double checkCpd(size_t n, size_t m, double sigma2, std::mt19937& gen)
+{
+    std::uniform_real_distribution<double> coord(-1, 1);
+    cpd::Matrix fixed(n, 3);
+    cpd::Matrix moving(m, 3);
+    for (size_t i = 0; i < 3 * n; ++i)
+        fixed.data()[i] = coord(gen);
+    for (size_t i = 0; i < 3 * m; ++i)
+        moving.data()[i] = coord(gen);
+
+    const double outliers = 0.1;
+    std::vector<double> p1(m), pt1(n), px(3 * m), work(m);
+    double l = gaussAffinity(fixed.data(), n, moving.data(), m, sigma2,
+        outliers, p1.data(), pt1.data(), px.data(), work.data());
+    cpd::Probabilities ref =
+        cpd::GaussTransformDirect().compute(fixed, moving, sigma2, outliers);
+
+    auto values = [](const double *v, size_t size)
+        { return std::vector<double>(v, v + size); };
+    double err = std::abs(l - ref.l) / (std::max)(std::abs(ref.l), 1.0);
+    err = (std::max)(err, error(p1, values(ref.p1.data(), m)));
+    err = (std::max)(err, error(pt1, values(ref.pt1.data(), n)));
+    err = (std::max)(err, error(px, values(ref.px.data(), 3 * m)));
+    return err;
+}
+
+
+const size_t Sizes[][2] =
+    { { 1, 1 }, { 3, 5 }, { 7, 13 }, { 17, 31 }, { 37, 101 },
+      { 129, 67 }, { 250, 1003 } };
+const double Sigma2s[] = { 0.01, 0.3, 5 };
+
+// Run 'check' over each size and sigma2 and return the number of results
+// out of 'tolerance'.
+template <typename Check>
+int checkAll(Check check, const char *type, double tolerance)
+{
+    std::mt19937 gen(1);
+    int failures = 0;
+    for (auto& size : Sizes)
+        for (double sigma2 : Sigma2s)
+        {
+            double err = check(size[0], size[1], sigma2, gen);
+            if (err > tolerance)
+            {
+                std::cerr << "FAILED " << type << " n = " << size[0] <<
+                    " m = " << size[1] << " sigma2 = " << sigma2 <<
+                    ": relative error " << err << "\n";
+                failures++;
+            }
+        }
+    return failures;
+}
+
+} // unnamed namespace
+
+
+int main()
+{
+    int failures = checkAll(check<double>, "double", 1e-12) +
+        checkAll(check<float>, "float", 1e-6) +
+        checkAll(checkCpd, "cpd", 1e-12);
+    std::cout << "gauss-transform-check: kernel " << gaussAffinityKernel() <<
+        ", " << failures << " failures\n";
+    return failures ? 1 : 0;
+}